@@ -0,0 +1,144 @@
+#include "bloomfilter.h"
+#include "utils.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* Compares the bloom filter of bloomfilter.c with the previous filter, which
+ * set three bits at independent positions of the same 2^31-bit array, for the
+ * false positive rate, the probes per second and the bits per key.
+ *
+ * Format: bench [-keys n] [-probes n] */
+
+#define LEGACY_SIZE (0x1ULL << 31)
+
+/* static variables */
+static uint64_t *legacy_bits;
+
+/* static function prototypes */
+static uint32_t legacy_hash(const uint64_t key, const uint64_t a,
+                            const uint64_t b);
+static void legacy_add(const uint64_t key);
+static int_fast8_t legacy_lookup(const uint64_t key);
+/* Returns the i-th key of a key set: sequential keys or keys spread over the
+ * whole key space. */
+static inline uint64_t nth_key(const uint64_t i, const int sequential);
+static double now();
+/* Runs the benchmark for one filter and one key set. */
+static void run(const char *name, void (*add)(const uint64_t key),
+                int_fast8_t (*lookup)(const uint64_t key), const uint64_t keys,
+                const uint64_t probes, const int sequential);
+
+/* static functions */
+static uint32_t legacy_hash(const uint64_t key, const uint64_t a,
+                            const uint64_t b) {
+    uint64_t left = key >> 32;
+    uint64_t right = key & UINT32_MAX;
+    left = (uint64_t)(a * left + b);
+    right = (uint64_t)(a * right + b);
+    return (left ^ right) & INT32_MAX;
+}
+
+static void legacy_add(const uint64_t key) {
+    uint32_t h = legacy_hash(key, 31, 1150616525);
+    legacy_bits[h >> 6] |= 0x1ULL << (h & 63);
+    h = legacy_hash(key, 23, 572251735);
+    legacy_bits[h >> 6] |= 0x1ULL << (h & 63);
+    h = legacy_hash(key, 47, 258054038);
+    legacy_bits[h >> 6] |= 0x1ULL << (h & 63);
+}
+
+static int_fast8_t legacy_lookup(const uint64_t key) {
+    uint32_t h = legacy_hash(key, 31, 1150616525);
+    if (((legacy_bits[h >> 6] >> (h & 63)) & 0x1) == 0)
+        return -1;
+    h = legacy_hash(key, 23, 572251735);
+    if (((legacy_bits[h >> 6] >> (h & 63)) & 0x1) == 0)
+        return -1;
+    h = legacy_hash(key, 47, 258054038);
+    return ((legacy_bits[h >> 6] >> (h & 63)) & 0x1) ? 0 : -1;
+}
+
+static inline uint64_t nth_key(const uint64_t i, const int sequential) {
+    if (sequential) {
+        return i;
+    }
+    /* The splitmix64 finalizer is a bijection, so keys never repeat */
+    uint64_t key = i;
+    key = (key ^ (key >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    key = (key ^ (key >> 27)) * 0x94d049bb133111ebULL;
+    return key ^ (key >> 31);
+}
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void run(const char *name, void (*add)(const uint64_t key),
+                int_fast8_t (*lookup)(const uint64_t key), const uint64_t keys,
+                const uint64_t probes, const int sequential) {
+    double start = now();
+    for (uint64_t i = 0; i < keys; i++) {
+        add(nth_key(i, sequential));
+    }
+    double add_time = now() - start;
+
+    /* Probes keys which were added, then keys which were not */
+    uint64_t misses = 0;
+    start = now();
+    for (uint64_t i = 0; i < probes; i++) {
+        misses += (lookup(nth_key(i % keys, sequential)) != 0);
+    }
+    double hit_time = now() - start;
+    uint64_t false_positives = 0;
+    start = now();
+    for (uint64_t i = 0; i < probes; i++) {
+        false_positives += (lookup(nth_key(keys + i, sequential)) == 0);
+    }
+    double miss_time = now() - start;
+
+    if (misses > 0) {
+        fprintf(stderr, "Error: %s lost %lu keys\n", name, misses);
+        exit(EXIT_FAILURE);
+    }
+    printf("%-8s %-10s fpr %.6f  add %7.2f M/s  hit %7.2f M/s  "
+           "miss %7.2f M/s\n",
+           name, sequential ? "sequential" : "random",
+           (double)false_positives / probes, keys / add_time / 1e6,
+           probes / hit_time / 1e6, probes / miss_time / 1e6);
+}
+
+int main(int argc, char *argv[]) {
+    int keys_index = get_arg_index(argc, argv, "-keys");
+    int probes_index = get_arg_index(argc, argv, "-probes");
+    uint64_t keys = (keys_index == -1 || keys_index + 1 >= argc)
+                        ? 50000000
+                        : strtoull(argv[keys_index + 1], NULL, 10);
+    uint64_t probes = (probes_index == -1 || probes_index + 1 >= argc)
+                          ? 10000000
+                          : strtoull(argv[probes_index + 1], NULL, 10);
+    if (keys == 0) {
+        fprintf(stderr, "Error: -keys must be positive\n");
+        exit(EXIT_FAILURE);
+    }
+    printf("%lu keys, %lu probes\n", keys, probes);
+
+    for (int sequential = 0; sequential <= 1; sequential++) {
+        legacy_bits = safe_calloc(LEGACY_SIZE >> 6, sizeof(uint64_t));
+        run("legacy", legacy_add, legacy_lookup, keys, probes, sequential);
+        printf("%-8s %.1f bits per key\n", "legacy",
+               (double)LEGACY_SIZE / keys);
+        free(legacy_bits);
+
+        bloomfilter_t bf;
+        init_bloomfilter(&bf);
+        run("scalable", bf.add, bf.lookup, keys, probes, sequential);
+        printf("%-8s %.1f bits per key\n", "scalable", (double)bf.size() / keys);
+        bf.free();
+    }
+    return 0;
+}
@@ -1,111 +1,372 @@
 #include "bloomfilter.h"
+#include "definition.h"
 #include "utils.h"
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+/* Every stage is an array of 64-byte lines, one cache line each. A key picks
+ * one line and sets its k bits inside it, so that add() and lookup() touch a
+ * single cache line per stage. The position of the i-th bit in the line is
+ * the top 9 bits of the hash multiplied by the i-th salt. */
+#define LINE_BITS 512
+#define LINE_WORDS (LINE_BITS / 64)
+#define LINE_BYTES (LINE_BITS / 8)
+#define MAX_BLOOM_HASHES 16
+/* A stage of n keys with a false positive rate p gets k = log2(1/p) bits per
+ * key set and k / ln(2) bits per key, the optimum of a plain bloom filter,
+ * plus BLOCK_OVERHEAD for the uneven load of the lines. */
+#define BLOCK_OVERHEAD 1.1
+#define STATE_MAGIC 0x3154534d4f4f4c42ULL /* "BLOOMST1" */
+#define STATE_VERSION 3
+/* The first page of the state file holds the stage table. The bits of every
+ * stage follow it, each a whole number of pages, so that they are page
+ * aligned in the mapping. */
+#define STATE_HEADER_SIZE 4096
+#define MAX_STAGES 32
+
+typedef struct stage_info {
+    /* offset of the bits in the state file */
+    uint64_t offset;
+    uint64_t line_count;
+    /* the stage is full once it holds capacity keys */
+    uint64_t capacity;
+    uint64_t key_count;
+    /* number of bits set per key */
+    uint32_t hash_count;
+    uint32_t reserved;
+} stage_info_t;
+
+typedef struct state_header {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t stage_count;
+    stage_info_t stages[MAX_STAGES];
+} state_header_t;
 
 static char state_file[] = "bf.state";
-static uint64_t *bit64;
-static const size_t bloom_filter_size = 0x1ULL << 31; /* 2^31 bits */
+/* the state file while it is open, -1 before open() */
+static int state_fd = -1;
+/* the mapping of the first page of the state file, or of anonymous memory
+ * until open() */
+static state_header_t *header = NULL;
+/* the mapping of the bits of every stage */
+static uint64_t *stage_bits[MAX_STAGES];
+/* odd multipliers, one per bit set */
+static const uint64_t salts[MAX_BLOOM_HASHES] = {
+    0x9e96f7509ea2a537ULL, 0xab9f01dc2cad988fULL, 0x760500e7c4baee47ULL,
+    0x714682adf218f763ULL, 0x5e5f039779629c87ULL, 0x6b581a55ef030a99ULL,
+    0x288ea8708b011a07ULL, 0x1777b3e59e120a4dULL, 0xcc03fc417533d9b1ULL,
+    0xeae967653d748647ULL, 0x68e43b9a35a75d8bULL, 0x348e8d2fab9460d9ULL,
+    0x261e62d39ac21293ULL, 0x73cd314678b38663ULL, 0xb4a67a9d1ae0206bULL,
+    0x2965998cab8bcf19ULL,
+};
 
 /* static function prototypes */
-/* Loads the bloom filter from filepath. */
-static void load(const char *filepath);
-/* Saves the current bloom filter. */
-static void save(const char *filepath);
+/* Maps the bloom filter state at filepath, creating an empty one first if it
+ * does not exist. */
+static void open_state(const char *filepath);
+/* Writes the pages of the state changed since it was opened to disk. */
+static void save();
 /* Frees the memory allocated for the bloom filter. */
 static void free_memory();
-/* Sets k entries in the bloom filter to 1.
- * k: the number of hash functions */
+/* Sets k bits of one line in the last stage to 1.
+ * k: the number of hash functions of the stage */
 static void add(const uint64_t key);
-/* Checks if a given key is in the database by looking up the bloom filter.
+/* Checks if a given key is in the database by looking up every stage.
  * Returns 0 if the key is in the database, otherwise returns -1. */
 static int_fast8_t lookup(const uint64_t key);
-static uint32_t hash(const uint64_t key, const uint64_t a, const uint64_t b);
+/* Returns the number of bits of all stages. */
+static uint64_t size();
+/* Returns the 64-bit hash of key (the finalizer of MurmurHash3). */
+static inline uint64_t hash(uint64_t key);
+/* Creates a state file without stages at filepath. */
+static void create_state(const char *filepath);
+/* Appends a stage to the stage table and maps its bits, growing the state
+ * file first if one is open. */
+static void add_stage();
+/* Unmaps the header and the bits of every stage. */
+static void unmap_state();
+/* Maps size bytes of memory, backed by the file from offset if fd is not -1.
+ */
+static void *map_region(const int fd, const uint64_t offset,
+                        const size_t size);
+/* Computes the line of the key in stage and the mask of its k bits in the
+ * line. */
+static inline uint64_t *get_line(const uint32_t stage, const uint64_t key,
+                                 uint64_t mask[]);
+/* Returns a non zero value if every bit of mask is set in line. */
+static inline int contains_mask(const uint64_t *line, const uint64_t mask[]);
 
 /* static functions */
-static void load(const char *filepath) {
+static void open_state(const char *filepath) {
     puts("loading bloom filter ...");
-    FILE *fp = safe_fopen(filepath, "rb");
-    safe_fread(bit64, sizeof(uint64_t), bloom_filter_size >> 6, fp);
-    fclose(fp);
+    if (file_exists(filepath) == -1) {
+        create_state(filepath);
+    }
+
+    int fd = open(filepath, O_RDWR);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        fprintf(stderr, "Error: failed to open %s\n", filepath);
+        exit(EXIT_FAILURE);
+    }
+    state_header_t fields;
+    int valid = st.st_size >= STATE_HEADER_SIZE &&
+                pread(fd, &fields, sizeof(state_header_t), 0) ==
+                    sizeof(state_header_t) &&
+                fields.magic == STATE_MAGIC &&
+                fields.version == STATE_VERSION &&
+                fields.stage_count <= MAX_STAGES;
+    /* The stages must follow each other and fit in the file */
+    uint64_t end = STATE_HEADER_SIZE;
+    for (uint32_t i = 0; valid && i < fields.stage_count; i++) {
+        const stage_info_t *stage = &fields.stages[i];
+        valid = stage->offset == end && stage->line_count > 0 &&
+                stage->line_count * LINE_BYTES % STATE_HEADER_SIZE == 0 &&
+                stage->hash_count >= 1 &&
+                stage->hash_count <= MAX_BLOOM_HASHES;
+        end += stage->line_count * LINE_BYTES;
+    }
+    if (!valid || end > (uint64_t)st.st_size) {
+        fprintf(stderr, "Error: unsupported bloom filter state in %s\n",
+                filepath);
+        exit(EXIT_FAILURE);
+    }
+
+    /* Pages are read on first touch and written back by the kernel */
+    unmap_state();
+    state_fd = fd;
+    header = map_region(fd, 0, STATE_HEADER_SIZE);
+    for (uint32_t i = 0; i < header->stage_count; i++) {
+        const stage_info_t *stage = &header->stages[i];
+        stage_bits[i] =
+            map_region(fd, stage->offset, stage->line_count * LINE_BYTES);
+    }
+    if (header->stage_count == 0) {
+        add_stage();
+    }
 }
 
-static void save(const char *filepath) {
+static void save() {
     puts("saving bloom filter ...");
-    /* TODO:
-     * reduce the overhead: http://www.cplusplus.com/reference/cstdio/rewind/ */
-    FILE *fp = safe_fopen(filepath, "wb");
-    safe_fwrite(bit64, sizeof(uint64_t), bloom_filter_size >> 6, fp);
-    fclose(fp);
+    /* Only the dirty pages of the mappings are written */
+    int failed = msync(header, STATE_HEADER_SIZE, MS_SYNC) == -1;
+    for (uint32_t i = 0; i < header->stage_count; i++) {
+        failed |= msync(stage_bits[i],
+                        header->stages[i].line_count * LINE_BYTES,
+                        MS_SYNC) == -1;
+    }
+    if (failed) {
+        fprintf(stderr, "Error: failed to save the bloom filter\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void free_memory() {
+    unmap_state();
+    if (state_fd != -1) {
+        close(state_fd);
+        state_fd = -1;
+    }
+}
+
+static void create_state(const char *filepath) {
+    char tmp_filepath[MAX_PATH + 1];
+    snprintf(tmp_filepath, MAX_PATH, "%s.tmp", filepath);
+    FILE *fp = safe_fopen(tmp_filepath, "wb");
+    static char page[STATE_HEADER_SIZE];
+    state_header_t fields = {
+        .magic = STATE_MAGIC,
+        .version = STATE_VERSION,
+        .stage_count = 0,
+    };
+    memcpy(page, &fields, sizeof(state_header_t));
+    safe_fwrite(page, sizeof(char), STATE_HEADER_SIZE, fp);
+    safe_commit_file(fp, tmp_filepath, filepath);
+}
+
+static void add_stage() {
+    uint32_t index = header->stage_count;
+    stage_info_t *stage = &header->stages[index];
+    const stage_info_t *last = (index == 0) ? NULL : stage - 1;
+
+    /* The rate of stage i is BLOOM_FALSE_POSITIVE_RATE / 2^(i + 1), so k is
+     * ceil(log2(1/rate)) */
+    double rate = BLOOM_FALSE_POSITIVE_RATE / (double)(0x2ULL << index);
+    uint32_t k = 0;
+    for (double r = rate; r < 1.0; r *= 2) {
+        k++;
+    }
+    uint64_t capacity = (uint64_t)BLOOM_EXPECTED_KEYS << index;
+    uint64_t bits = capacity * (k / 0.6931471805599453 * BLOCK_OVERHEAD);
+    /* Rounds up to a whole number of pages */
+    const uint64_t page_lines = STATE_HEADER_SIZE / LINE_BYTES;
+    uint64_t line_count = (bits / LINE_BITS + page_lines) / page_lines *
+                          page_lines;
+    uint64_t offset = (last == NULL)
+                          ? STATE_HEADER_SIZE
+                          : last->offset + last->line_count * LINE_BYTES;
+    size_t stage_size = line_count * LINE_BYTES;
+
+    if (state_fd != -1) {
+        /* Drops whatever a crash left behind the last stage, then extends the
+         * file by a hole for the new stage. The stage table only counts the
+         * stage once the file holds it. */
+        if (ftruncate(state_fd, offset) == -1 ||
+            ftruncate(state_fd, offset + stage_size) == -1 ||
+            fsync(state_fd) == -1) {
+            fprintf(stderr, "Error: failed to grow the bloom filter\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    stage_bits[index] = map_region(state_fd, offset, stage_size);
+    stage->offset = offset;
+    stage->line_count = line_count;
+    stage->capacity = capacity;
+    stage->key_count = 0;
+    stage->hash_count = MIN(MAX(k, 1), MAX_BLOOM_HASHES);
+    stage->reserved = 0;
+    header->stage_count++;
+}
+
+static void unmap_state() {
+    if (header == NULL) {
+        return;
+    }
+    for (uint32_t i = 0; i < header->stage_count; i++) {
+        munmap(stage_bits[i], header->stages[i].line_count * LINE_BYTES);
+        stage_bits[i] = NULL;
+    }
+    munmap(header, STATE_HEADER_SIZE);
+    header = NULL;
 }
 
-static void free_memory() { free(bit64); }
+static void *map_region(const int fd, const uint64_t offset,
+                        const size_t size) {
+    int flags = (fd == -1) ? MAP_PRIVATE | MAP_ANONYMOUS : MAP_SHARED;
+    void *region =
+        mmap(NULL, size, PROT_READ | PROT_WRITE, flags, fd, (off_t)offset);
+    if (region == MAP_FAILED) {
+        fprintf(stderr, "Error: failed to map the bloom filter\n");
+        exit(EXIT_FAILURE);
+    }
+    return region;
+}
 
 static void add(const uint64_t key) {
-    uint32_t h, index;
-    uint_fast8_t shift;
-
-    /* hash 1 */
-    h = hash(key, 31, 1150616525);
-    index = h >> 6;
-    shift = h - (index << 6);
-    // printf("index: %8u, shift: %2u\n", index, shift);
-    bit64[index] |= (0x1ULL << shift);
-
-    /* hash 2 */
-    h = hash(key, 23, 572251735);
-    index = h >> 6;
-    shift = h - (index << 6);
-    // printf("index: %8u, shift: %2u\n", index, shift);
-    bit64[index] |= (0x1ULL << shift);
-
-    /* hash 3 */
-    h = hash(key, 47, 258054038);
-    index = h >> 6;
-    shift = h - (index << 6);
-    // printf("index: %8u, shift: %2u\n", index, shift);
-    bit64[index] |= (0x1ULL << shift);
+    uint32_t index = header->stage_count - 1;
+    uint64_t mask[LINE_WORDS];
+    uint64_t *line = get_line(index, key, mask);
+    /* A key whose bits are all set already, because it was added before or
+     * by chance, leaves the stage as it is and does not count towards its
+     * capacity */
+    if (contains_mask(line, mask)) {
+        return;
+    }
+    for (int i = 0; i < LINE_WORDS; i++) {
+        line[i] |= mask[i];
+    }
+    /* The last stage takes every key from then on if the table is full */
+    stage_info_t *stage = &header->stages[index];
+    if (++stage->key_count == stage->capacity &&
+        header->stage_count < MAX_STAGES) {
+        add_stage();
+    }
 }
 
 static int_fast8_t lookup(const uint64_t key) {
-    int_fast8_t is_in_database = 1;
-    uint32_t h, index;
-    uint_fast8_t shift;
-
-    /* hash 1 */
-    h = hash(key, 31, 1150616525);
-    index = h >> 6;
-    shift = h - (index << 6);
-    is_in_database &= ((bit64[index] >> shift) & 0x1);
-    if (!is_in_database)
-        return -1;
-
-    /* hash 2 */
-    h = hash(key, 23, 572251735);
-    index = h >> 6;
-    shift = h - (index << 6);
-    is_in_database &= ((bit64[index] >> shift) & 0x1);
-    if (!is_in_database)
-        return -1;
-
-    /* hash 3 */
-    h = hash(key, 47, 258054038);
-    index = h >> 6;
-    shift = h - (index << 6);
-    is_in_database &= ((bit64[index] >> shift) & 0x1);
-
-    /* Returns 0 if the key is found, otherwise returns -1 */
-    return is_in_database ? 0 : -1;
+    uint32_t stage_count = header->stage_count;
+    const uint64_t *lines[MAX_STAGES];
+    uint64_t masks[MAX_STAGES][LINE_WORDS];
+    /* A key that is not in the filter is looked up in every stage, so the
+     * lines of all stages are fetched at once rather than one after another
+     */
+    for (uint32_t i = 0; i < stage_count; i++) {
+        lines[i] = get_line(i, key, masks[i]);
+        __builtin_prefetch(lines[i]);
+    }
+    /* The last stage holds the most recent keys */
+    for (int_fast32_t i = stage_count - 1; i >= 0; i--) {
+        if (contains_mask(lines[i], masks[i])) {
+            /* Returns 0 if the key is found, otherwise returns -1 */
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static uint64_t size() {
+    uint64_t bits = 0;
+    for (uint32_t i = 0; i < header->stage_count; i++) {
+        bits += header->stages[i].line_count * LINE_BITS;
+    }
+    return bits;
 }
 
-static uint32_t hash(const uint64_t key, const uint64_t a, const uint64_t b) {
-    uint64_t left = key >> 32;
-    uint64_t right = key & UINT32_MAX;
-    left = (uint64_t)(a * left + b);
-    right = (uint64_t)(a * right + b);
-    return (left ^ right) & INT32_MAX;
+static inline uint64_t hash(uint64_t key) {
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    key *= 0xc4ceb9fe1a85ec53ULL;
+    key ^= key >> 33;
+    return key;
+}
+
+static inline uint64_t *get_line(const uint32_t stage, const uint64_t key,
+                                 uint64_t mask[]) {
+    const stage_info_t *info = &header->stages[stage];
+    /* Every stage hashes the key differently, so that keys sharing a line in
+     * one stage do not share one in the others */
+    uint64_t h = hash(key + stage * 0x9e3779b97f4a7c15ULL);
+    /* The high half of the hash picks the line, the low half the bits */
+    uint64_t *line =
+        stage_bits[stage] + ((h >> 32) * info->line_count >> 32) * LINE_WORDS;
+    uint64_t low = h & UINT32_MAX;
+
+    memset(mask, 0, LINE_WORDS * sizeof(uint64_t));
+    for (uint32_t i = 0; i < info->hash_count; i++) {
+        uint32_t pos = (low * salts[i]) >> 55;
+        mask[pos >> 6] |= 0x1ULL << (pos & 63);
+    }
+    return line;
+}
+
+static inline int contains_mask(const uint64_t *line, const uint64_t mask[]) {
+#if defined(__AVX2__)
+    /* The mask is built from registers rather than loaded from memory, which
+     * would stall on forwarding the stores that built it */
+    __m256i m0 = _mm256_set_epi64x(mask[3], mask[2], mask[1], mask[0]);
+    __m256i m1 = _mm256_set_epi64x(mask[7], mask[6], mask[5], mask[4]);
+    __m256i l0 = _mm256_load_si256((const __m256i *)line);
+    __m256i l1 = _mm256_load_si256((const __m256i *)(line + 4));
+    /* testc(a, b) is 1 if every bit of b is set in a */
+    return _mm256_testc_si256(l0, m0) & _mm256_testc_si256(l1, m1);
+#elif defined(__SSE2__)
+    __m128i missing = _mm_setzero_si128();
+    for (int i = 0; i < LINE_WORDS; i += 2) {
+        __m128i m = _mm_set_epi64x(mask[i + 1], mask[i]);
+        __m128i l = _mm_load_si128((const __m128i *)(line + i));
+        missing = _mm_or_si128(missing, _mm_andnot_si128(l, m));
+    }
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(missing, _mm_setzero_si128())) ==
+           0xffff;
+#else
+    uint64_t missing = 0;
+    for (int i = 0; i < LINE_WORDS; i++) {
+        missing |= mask[i] & ~line[i];
+    }
+    return missing == 0;
+#endif
 }
 
 /* extern functions */
@@ -113,12 +374,17 @@ void init_bloomfilter(bloomfilter_t *bf) {
     puts("initializing bloom filter ...");
 
     bf->state_file = state_file;
-    bf->load = load;
+    bf->open = open_state;
     bf->save = save;
     bf->free = free_memory;
     bf->add = add;
     bf->lookup = lookup;
+    bf->size = size;
 
-    size_t bit64_length = bloom_filter_size >> 6;
-    bit64 = safe_calloc(bit64_length, sizeof(uint64_t));
-}
\ No newline at end of file
+    /* Anonymous pages are zeroed, page aligned and only backed by memory
+     * once touched. open() replaces them with the state file. */
+    header = map_region(-1, 0, STATE_HEADER_SIZE);
+    header->magic = STATE_MAGIC;
+    header->version = STATE_VERSION;
+    add_stage();
+}
@@ -2,24 +2,42 @@
 #define BLOOMFILTER_H
 #include <stdint.h>
 
+/* The filter is scalable: it starts with one stage sized for
+ * BLOOM_EXPECTED_KEYS keys and adds a stage twice the size of the last one
+ * whenever the last one is full. The false positive rates of the stages halve
+ * from one stage to the next, so that the rate of the whole filter stays below
+ * BLOOM_FALSE_POSITIVE_RATE however many stages it has. Both can be overridden
+ * at compile time; a saved filter keeps the stages it was built with. */
+#ifndef BLOOM_EXPECTED_KEYS
+#define BLOOM_EXPECTED_KEYS (1 << 20)
+#endif
+#ifndef BLOOM_FALSE_POSITIVE_RATE
+#define BLOOM_FALSE_POSITIVE_RATE 0.01
+#endif
+
 typedef struct bloomfilter {
     /* Used for loading/saving the bloom filter */
     char *state_file;
-    /* Loads the bloom filter from filepath. */
-    void (*load)(const char *filepath);
-    /* Saves the current bloom filter. */
+    /* Maps the bloom filter state at filepath into memory, creating an empty
+     * one if it does not exist. Changes go to the file from then on. */
+    void (*open)(const char *filepath);
+    /* Writes the pages changed since the state was opened to disk. */
     void (*save)();
     /* Frees the memory allocated for the bloom filter. */
     void (*free)();
-    /* Sets k entries in the bloom filter to 1.
-     * k: the number of hash functions */
+    /* Sets k bits of one cache line in the last stage of the bloom filter to
+     * 1, adding a stage once the last one is full.
+     * k: the number of hash functions of the stage */
     void (*add)(const uint64_t key);
-    /* Checks if a given key is in the database by looking up the bloom filter.
+    /* Checks if a given key is in the database by looking up every stage of
+     * the bloom filter.
      * Returns 0 if the key is in the database, otherwise returns -1. */
     int_fast8_t (*lookup)(const uint64_t key);
+    /* Returns the number of bits of all stages. */
+    uint64_t (*size)();
 } bloomfilter_t;
 
 /* Initializes the bloom filter. */
 void init_bloomfilter(bloomfilter_t *bf);
 
-#endif
\ No newline at end of file
+#endif
@@ -1,21 +1,32 @@
 #include "bptree.h"
+#include "codec.h"
 #include "definition.h"
+#include "slab.h"
+#include "sstable.h"
 #include "utils.h"
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #define ORDER 5
 #define MAX_KEY (ORDER - 1)
 #define MAX_BUFFER_SIZE 2000000
-#define MAX_KEY_PER_FILE (MAX_BUFFER_SIZE / 2)
+/* The tree is also full once its values take this many bytes, so that large
+ * values cannot grow it without bound. */
+#ifndef MAX_TREE_BYTES
+#define MAX_TREE_BYTES (256 << 20)
+#endif
 
 /* static variables */
 static node_t *head = NULL;
-static char *value_buf[MAX_BUFFER_SIZE];
+/* number of values stored in the tree */
 static size_t buf_key_count = 0;
+/* the encoded values of the tree, dropped at once when the whole tree is
+ * saved or freed */
+static slab_arena_t values;
 static uint64_t min_key = UINT64_MAX;
 static uint64_t max_key = 0;
 
@@ -25,10 +36,11 @@ static void save(metadata_t *metadata, const char *filepath);
 static void split_and_save_one(metadata_t *metadata, const char *filepath,
                                const uint64_t key);
 static void free_memory();
-static void insert(const uint64_t key, char *value);
+static void insert(const uint64_t key, const char *value,
+                   const size_t length);
 static const char *search(const uint64_t key);
-static void scan(char *ptrs[], const uint64_t start_key,
-                 const uint64_t end_key);
+static void seek(bptree_cursor_t *cursor, const uint64_t key);
+static bool next(bptree_cursor_t *cursor, uint64_t *key, const char **value);
 static int_fast8_t is_empty();
 static int_fast8_t is_full();
 static uint64_t get_min_key();
@@ -40,8 +52,15 @@ static uint64_t get_max_key();
 static void free_node(node_t *node);
 /* Frees the memory allocated for tree whose root is node. */
 static void free_tree(node_t *node);
-/* Stores the value in the value buffer and returns the pointer to it. */
+/* Frees the internal nodes of the tree whose root is node, keeping the
+ * leaves. */
+static void free_internal_nodes(node_t *node);
+/* Copies the encoded value and returns the pointer to the copy. */
 static char *store_value(const char *value);
+/* Frees the copy of the value. */
+static void release_value(char *value);
+/* Frees the copies of all values. */
+static void release_all_values();
 /* Gets the index where the key belongs to from the node. */
 static int_fast8_t get_key_idx(const node_t *node, const uint64_t key);
 /* Searches down from the root node and finds the leaf node where the key
@@ -57,8 +76,15 @@ static node_t *split_leaf(node_t *leaf, const uint64_t keys[], void *ptrs[]);
 /* Splits the overflowed internal node into two parts and returns the pointer to
  * the new internal node. */
 static node_t *split_node(node_t *node, const uint64_t keys[], void *ptrs[]);
-/* Inserts a key and a value into leaf node. */
-static void insert_into_leaf(node_t *leaf, const uint64_t key, char *value);
+/* Returns the minimum key in the subtree whose root is node. */
+static uint64_t subtree_min_key(const node_t *node);
+/* Builds the internal levels bottom-up on top of count nodes of the same level,
+ * which are linked by next from left to right, and makes the result the new
+ * tree. */
+static void build_levels(node_t *first, size_t count);
+/* Inserts a key and an encoded value into leaf node. */
+static void insert_into_leaf(node_t *leaf, const uint64_t key,
+                             const char *value);
 /* Inserts a key into internal node. */
 static void insert_into_node(node_t *node, node_t *child, const uint64_t key);
 
@@ -71,15 +97,44 @@ static void load(const char *filepath, const uint64_t total_keys) {
         exit(EXIT_FAILURE);
     }
 
-    FILE *file = safe_fopen(filepath, "rb");
+    sstable_t table;
+    sstable_iter_t iter;
     uint64_t key;
-    static char value[VALUE_LENGTH + 1];
-    for (int i = 0; i < total_keys; i++) {
-        safe_fread(&key, sizeof(uint64_t), 1, file);
-        safe_fread(value, sizeof(char), VALUE_LENGTH + 1, file);
-        insert(key, value);
+    const char *value;
+    sstable_open(&table, filepath);
+    if (table.total_keys == 0) {
+        sstable_close(&table);
+        return;
     }
-    fclose(file);
+
+    /* The file is sorted, so the leaves are packed from left to right and
+     * the internal levels are built on top of them afterwards */
+    size_t leaf_count = (table.total_keys + MAX_KEY - 1) / MAX_KEY;
+    size_t base = table.total_keys / leaf_count;
+    size_t extra = table.total_keys % leaf_count;
+    node_t *first_leaf = NULL;
+    node_t *prev = NULL;
+    sstable_iter_init(&iter, &table);
+    for (size_t i = 0; i < leaf_count; i++) {
+        node_t *leaf = create_leaf();
+        leaf->key_count = base + (i < extra);
+        for (int j = 0; j < leaf->key_count; j++) {
+            sstable_iter_next(&iter, &key, &value);
+            leaf->keys[j] = key;
+            leaf->ptrs[j] = store_value(value);
+        }
+        if (prev == NULL) {
+            first_leaf = leaf;
+        } else {
+            prev->next = leaf;
+        }
+        prev = leaf;
+    }
+    min_key = first_leaf->keys[0];
+    max_key = prev->keys[prev->key_count - 1];
+    sstable_close(&table);
+
+    build_levels(first_leaf, leaf_count);
 }
 
 static void save(metadata_t *metadata, const char *filepath) {
@@ -95,30 +150,20 @@ static void save(metadata_t *metadata, const char *filepath) {
         node = node->ptrs[0];
     }
 
-    FILE *file = safe_fopen(filepath, "wb");
-    size_t total_keys = 0;
-    uint64_t start_key = node->keys[0];
-    uint64_t end_key;
+    sstable_writer_t writer;
+    sstable_writer_open(&writer, filepath);
     while (node != NULL) {
         for (int i = 0; i < node->key_count; i++) {
-            end_key = node->keys[i];
-            safe_fwrite(&node->keys[i], sizeof(uint64_t), 1, file);
-            safe_fwrite(node->ptrs[i], sizeof(char), VALUE_LENGTH + 1, file);
-            total_keys++;
+            sstable_writer_append(&writer, node->keys[i], node->ptrs[i]);
         }
         node = node->next;
     }
-    fclose(file);
-
     /* Updates metatable */
-    metadata->start_key = start_key;
-    metadata->end_key = end_key;
-    metadata->total_keys = total_keys;
+    sstable_writer_close(&writer, metadata);
 
-    DEBUG(printf("saved %lu keys to %s\n", total_keys, filepath);)
+    release_all_values();
     free_tree(head);
     head = NULL;
-    buf_key_count = 0;
     min_key = UINT64_MAX;
     max_key = 0;
 }
@@ -136,9 +181,13 @@ static void split_and_save_one(metadata_t *metadata, const char *filepath,
     }
     node_t *first_leaf = node;
 
+    /* The saved part holds at most half of the keys, which halves the tree
+     * whether it is full by keys or by bytes */
+    int32_t half = buf_key_count / 2;
+
     /* Finds the position of the pass-in key in the tree */
     int32_t count = 0;
-    while (count <= MAX_KEY_PER_FILE) {
+    while (node != NULL && count <= half) {
         bool found = false;
         for (int i = 0; i < node->key_count; i++) {
             if (node->keys[i] >= key) {
@@ -155,133 +204,98 @@ static void split_and_save_one(metadata_t *metadata, const char *filepath,
     }
     DEBUG(printf("key %lu is the %dth key in the tree\n", key, count);)
 
-    /* Writes key-values to file until total keys exceeds the maximum capacity
-     * of a file or the current key is greater than or equal to the passed-in
-     * key */
-    data_t *data = safe_malloc(MAX_BUFFER_SIZE * sizeof(data_t));
-    FILE *file;
-    file = safe_fopen(filepath, "wb");
+    /* If the key is near the beginning of the tree, the left part stays in
+     * memory and the right half is written to the file. Otherwise the
+     * key-values which are smaller than the pass-in key are written to the
+     * file (maximum key-values to be written: half of the keys) and the right
+     * part stays in memory. */
+    bool keep_left = (count < half / 2);
+    int32_t limit = keep_left ? half : MIN(MAX(count - MAX_KEY, 0), half);
+
+    /* Cuts the leaf chain after the left part */
+    size_t left_keys = 0, left_leaves = 0, right_leaves = 0;
+    node_t *left_last = NULL;
     node = first_leaf;
-    if (count < MAX_BUFFER_SIZE / 4) {
-        /* Stores the left part of the tree to the buffer */
-        size_t total_keys = 0;
-        while (total_keys <= MAX_KEY_PER_FILE) {
-            for (int i = 0; i < node->key_count; i++) {
-                data[total_keys].key = node->keys[i];
-                data[total_keys].value = node->ptrs[i];
-                total_keys++;
-            }
-            node = node->next;
-        }
-        /* Writes the right half of the tree to the file */
-        size_t remaining_keys = total_keys;
-        total_keys = 0;
-        uint64_t start_key = node->keys[0];
-        uint64_t end_key;
-        while (node != NULL) {
-            for (int i = 0; i < node->key_count; i++) {
-                end_key = node->keys[i];
-                safe_fwrite(&node->keys[i], sizeof(uint64_t), 1, file);
-                safe_fwrite(node->ptrs[i], sizeof(char), VALUE_LENGTH + 1,
-                            file);
-                total_keys++;
-            }
-            node = node->next;
-        }
-        /* Updates metatable */
-        metadata->start_key = start_key;
-        metadata->end_key = end_key;
-        metadata->total_keys = total_keys;
-        DEBUG(printf("saved %lu keys to %s\n", total_keys, filepath);)
-
-        /* Clears the current B+ tree */
-        free_tree(head);
-        head = NULL;
-        buf_key_count = 0;
-        min_key = UINT64_MAX;
-        max_key = 0;
-
-        /* Rebuilds a new B+ tree */
-        DEBUG(printf("inserting the remaining part of size %lu to the new B+ "
-                     "tree ...\n",
-                     remaining_keys);)
-        for (int i = 0; i < remaining_keys; i++) {
-            insert(data[i].key, data[i].value);
-        }
-    } else {
-        /* Writes the key-values which are smaller than the pass-in key to the
-         * file (maximum key-values to be written: MAX_KEY_PER_FILE) */
-        size_t total_keys = 0;
-        uint64_t start_key = node->keys[0];
-        uint64_t end_key;
-        int32_t max_key_count = MIN(count - MAX_KEY, MAX_KEY_PER_FILE);
-        while (total_keys <= max_key_count) {
-            for (int i = 0; i < node->key_count; i++) {
-                end_key = node->keys[i];
-                safe_fwrite(&node->keys[i], sizeof(uint64_t), 1, file);
-                safe_fwrite(node->ptrs[i], sizeof(char), VALUE_LENGTH + 1,
-                            file);
-                total_keys++;
-            }
-            node = node->next;
-        }
-        /* Updates metatable */
-        metadata->start_key = start_key;
-        metadata->end_key = end_key;
-        metadata->total_keys = total_keys;
-        DEBUG(printf("saved %lu keys to %s\n", total_keys, filepath);)
-
-        /* Saves the remaining part of the tree to the buffer */
-        total_keys = 0;
-        while (node != NULL) {
-            for (int i = 0; i < node->key_count; i++) {
-                data[total_keys].key = node->keys[i];
-                data[total_keys].value = node->ptrs[i];
-                total_keys++;
-            }
-            node = node->next;
-        }
-        /* Clears the current B+ tree */
-        free_tree(head);
-        head = NULL;
-        buf_key_count = 0;
-        min_key = UINT64_MAX;
-        max_key = 0;
-
-        /* Rebuilds a new B+ tree */
-        DEBUG(printf("inserting the remaining part of size %lu to the new B+ "
-                     "tree ...\n",
-                     total_keys);)
-        for (int i = 0; i < total_keys; i++) {
-            insert(data[i].key, data[i].value);
+    while (node != NULL && left_keys <= limit) {
+        left_keys += node->key_count;
+        left_leaves++;
+        left_last = node;
+        node = node->next;
+    }
+    node_t *right_first = node;
+    left_last->next = NULL;
+    for (; node != NULL; node = node->next) {
+        right_leaves++;
+    }
+
+    node_t *saved = keep_left ? right_first : first_leaf;
+    node_t *kept = keep_left ? first_leaf : right_first;
+    size_t kept_leaves = keep_left ? left_leaves : right_leaves;
+
+    /* The internal levels are rebuilt on top of the remaining leaves */
+    free_internal_nodes(head);
+    head = NULL;
+    min_key = UINT64_MAX;
+    max_key = 0;
+
+    /* Writes the saved part to the file and frees its leaves and values */
+    sstable_writer_t writer;
+    sstable_writer_open(&writer, filepath);
+    while (saved != NULL) {
+        node_t *next = saved->next;
+        for (int i = 0; i < saved->key_count; i++) {
+            sstable_writer_append(&writer, saved->keys[i], saved->ptrs[i]);
+            release_value(saved->ptrs[i]);
         }
+        free_node(saved);
+        saved = next;
+    }
+    /* Updates metatable */
+    sstable_writer_close(&writer, metadata);
+
+    if (kept == NULL) {
+        return;
     }
-    fclose(file);
-    free(data);
+    DEBUG(printf("rebuilding the B+ tree on top of %lu leaves ...\n",
+                 kept_leaves);)
+    build_levels(kept, kept_leaves);
+
+    node = kept;
+    while (node->next != NULL) {
+        node = node->next;
+    }
+    min_key = kept->keys[0];
+    max_key = node->keys[node->key_count - 1];
 }
 
 static void free_memory() {
-    if (head != NULL) {
-        free_tree(head);
-        head = NULL;
-    }
-    for (int i = 0; i < MAX_BUFFER_SIZE; i++) {
-        free(value_buf[i]);
+    slab_free(&values);
+    buf_key_count = 0;
+    if (head == NULL) {
+        return;
     }
+    free_tree(head);
+    head = NULL;
 }
 
-static void insert(const uint64_t key, char *value) {
+static void insert(const uint64_t key, const char *value,
+                   const size_t length) {
+    static char encoded[MAX_ENCODED_VALUE_SIZE];
+    value_encode(encoded, value, length);
+
     if (head == NULL) {
         node_t *leaf = create_leaf();
         head = leaf;
         leaf->keys[0] = key;
-        leaf->ptrs[0] = store_value(value);
+        leaf->ptrs[0] = store_value(encoded);
         leaf->key_count = 1;
+        min_key = MIN(key, min_key);
+        max_key = MAX(key, max_key);
         return;
     }
 
     node_t *node = find_leaf(head, key);
-    insert_into_leaf(node, key, value);
+    insert_into_leaf(node, key, encoded);
 }
 
 static const char *search(const uint64_t key) {
@@ -298,32 +312,38 @@ static const char *search(const uint64_t key) {
     return NULL;
 }
 
-/* Note: values in ptrs are set to NULL before calling this functions */
-static void scan(char *ptrs[], const uint64_t start_key,
-                 const uint64_t end_key) {
-    if (head == NULL) {
+static void seek(bptree_cursor_t *cursor, const uint64_t key) {
+    cursor->leaf = find_leaf(head, key);
+    cursor->idx = 0;
+    if (cursor->leaf == NULL) {
         return;
     }
+    while (cursor->idx < cursor->leaf->key_count &&
+           cursor->leaf->keys[cursor->idx] < key) {
+        cursor->idx++;
+    }
+}
 
-    node_t *node = find_leaf(head, start_key);
-    while (node != NULL) {
-        for (int i = 0; i < node->key_count; i++) {
-            if (node->keys[i] > end_key) {
-                return;
-            }
-            if (node->keys[i] >= start_key) {
-                /* values from ptrs[node->keys[i - 1] - start_key + 1] to
-                 * ptrs[node->keys[i] - start_key -1] remain NULL */
-                ptrs[node->keys[i] - start_key] = node->ptrs[i];
-            }
-        }
-        node = node->next;
+static bool next(bptree_cursor_t *cursor, uint64_t *key, const char **value) {
+    /* Moves on to the next leaf at the end of the current one */
+    while (cursor->leaf != NULL && cursor->idx >= cursor->leaf->key_count) {
+        cursor->leaf = cursor->leaf->next;
+        cursor->idx = 0;
     }
+    if (cursor->leaf == NULL) {
+        return false;
+    }
+    *key = cursor->leaf->keys[cursor->idx];
+    *value = cursor->leaf->ptrs[cursor->idx];
+    cursor->idx++;
+    return true;
 }
 
 static int_fast8_t is_empty() { return head == NULL; }
 
-static int_fast8_t is_full() { return buf_key_count == MAX_BUFFER_SIZE; }
+static int_fast8_t is_full() {
+    return buf_key_count == MAX_BUFFER_SIZE || values.bytes >= MAX_TREE_BYTES;
+}
 
 static uint64_t get_min_key() { return min_key; }
 
@@ -414,17 +434,88 @@ static void free_tree(node_t *node) {
     free_node(node);
 }
 
+static void free_internal_nodes(node_t *node) {
+    if (node->is_leaf) {
+        return;
+    }
+    for (int i = 0; i < node->key_count + 1; i++) {
+        free_internal_nodes(node->ptrs[i]);
+    }
+    free_node(node);
+}
+
 static char *store_value(const char *value) {
     if (buf_key_count >= MAX_BUFFER_SIZE) {
         fprintf(stderr, "Error: value_count exceeded its maximum value\n");
         exit(EXIT_FAILURE);
     }
-    char *ptr = value_buf[buf_key_count];
-    strncpy(ptr, value, VALUE_LENGTH);
+    size_t size = value_encoded_size(value);
+    char *ptr = slab_alloc(&values, size);
+    memcpy(ptr, value, size);
     buf_key_count++;
     return ptr;
 }
 
+static void release_value(char *value) {
+    slab_release(&values, value, value_encoded_size(value));
+    buf_key_count--;
+}
+
+static void release_all_values() {
+    slab_reset(&values);
+    buf_key_count = 0;
+}
+
+static uint64_t subtree_min_key(const node_t *node) {
+    while (node->is_leaf == false) {
+        node = node->ptrs[0];
+    }
+    return node->keys[0];
+}
+
+static void build_levels(node_t *first, size_t count) {
+    while (count > 1) {
+        /* Spreads the nodes evenly so that every parent has at least two
+         * children */
+        size_t parent_count = (count + ORDER - 1) / ORDER;
+        size_t base = count / parent_count;
+        size_t extra = count % parent_count;
+        node_t *child = first;
+        node_t *prev = NULL;
+        for (size_t i = 0; i < parent_count; i++) {
+            node_t *parent = create_node();
+            int_fast8_t child_count = base + (i < extra);
+            for (int j = 0; j < child_count; j++) {
+                node_t *next = child->next;
+                if (j > 0) {
+                    parent->keys[j - 1] = subtree_min_key(child);
+                }
+                parent->ptrs[j] = child;
+                child->parent = parent;
+                /* Internal nodes are only linked while the level above them
+                 * is being built */
+                if (child->is_leaf == false) {
+                    child->next = NULL;
+                }
+                child = next;
+            }
+            parent->key_count = child_count - 1;
+            if (prev == NULL) {
+                first = parent;
+            } else {
+                prev->next = parent;
+            }
+            prev = parent;
+        }
+        count = parent_count;
+    }
+    head = first;
+    head->parent = NULL;
+    if (head->is_leaf == false) {
+        head->next = NULL;
+    }
+}
+
 static int_fast8_t get_key_idx(const node_t *node, const uint64_t key) {
     int_fast8_t idx;
     for (idx = 0; idx < node->key_count; idx++) {
@@ -525,14 +616,16 @@ static node_t *split_node(node_t *node, const uint64_t keys[], void *ptrs[]) {
     return new_node;
 }
 
-static void insert_into_leaf(node_t *leaf, const uint64_t key, char *value) {
+static void insert_into_leaf(node_t *leaf, const uint64_t key,
+                             const char *value) {
     static uint64_t keys[MAX_KEY + 1];
     static void *ptrs[MAX_KEY + 1];
     int_fast8_t inserted_idx = get_key_idx(leaf, key);
 
     /* Overwrites the existing value */
     if (inserted_idx < leaf->key_count && key == leaf->keys[inserted_idx]) {
-        strncpy(leaf->ptrs[inserted_idx], value, VALUE_LENGTH);
+        release_value(leaf->ptrs[inserted_idx]);
+        leaf->ptrs[inserted_idx] = store_value(value);
         return;
     }
 
@@ -655,16 +748,16 @@ void init_bptree(bptree_t *bptree) {
     bptree->free_memory = free_memory;
     bptree->insert = insert;
     bptree->search = search;
-    bptree->scan = scan;
+    bptree->seek = seek;
+    bptree->next = next;
     bptree->is_empty = is_empty;
     bptree->is_full = is_full;
     bptree->get_min_key = get_min_key;
     bptree->get_max_key = get_max_key;
     // bptree->check = check;
     // bptree->show = show;
-    for (int i = 0; i < MAX_BUFFER_SIZE; i++) {
-        value_buf[i] = safe_malloc((VALUE_LENGTH + 1) * sizeof(char));
-    }
+
+    slab_init(&values);
 }
 
 #undef ORDER
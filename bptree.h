@@ -2,6 +2,7 @@
 #define BPTREE_H
 #include "definition.h"
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 typedef struct node {
@@ -17,6 +18,12 @@ typedef struct node {
     struct node *next;
 } node_t;
 
+/* A position in the leaf chain. It stays valid until the tree is modified. */
+typedef struct bptree_cursor {
+    const node_t *leaf;
+    int_fast8_t idx;
+} bptree_cursor_t;
+
 typedef struct bptree {
     /* Loads records from file. */
     void (*load)(const char *filepath, const uint64_t total_keys);
@@ -28,18 +35,22 @@ typedef struct bptree {
                                const uint64_t key);
     /* Frees the memory allocated for the B+ tree. */
     void (*free_memory)();
-    /* Inserts a record into the B+ tree. */
-    void (*insert)(const uint64_t key, char *value);
-    /* Searches key in the B+ tree. */
+    /* Inserts a record into the B+ tree. The value is copied in encoded form.
+     * A length of 0 inserts a tombstone. */
+    void (*insert)(const uint64_t key, const char *value, const size_t length);
+    /* Searches key in the B+ tree. Returns the encoded value (see codec.h),
+     * which may be a tombstone. */
     const char *(*search)(const uint64_t key);
-    /* Scans from start key to end key and assigns the address of the value (if
-     * found) to the pointer array. Note that the pointer array is initialized
-     * to NULL before passing it to this function. */
-    void (*scan)(char *ptrs[], const uint64_t start_key,
-                 const uint64_t end_key);
+    /* Positions the cursor at the first key greater than or equal to key. */
+    void (*seek)(bptree_cursor_t *cursor, const uint64_t key);
+    /* Reads the key and the encoded value (which may be a tombstone) at the
+     * cursor and moves the cursor to the next record. Returns false if there
+     * are no more records. */
+    bool (*next)(bptree_cursor_t *cursor, uint64_t *key, const char **value);
     /* Returns a non zero value if the tree is empty, and 0 otherwise. */
     int_fast8_t (*is_empty)();
-    /* Returns a non zero value if the tree is full, and 0 otherwise. */
+    /* Returns a non zero value if the tree holds its maximum number of keys or
+     * bytes of values, and 0 otherwise. */
     int_fast8_t (*is_full)();
     /* Returns the minimum key in the tree. */
     uint64_t (*get_min_key)();
@@ -0,0 +1,185 @@
+#include "cache.h"
+#include "utils.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/* expected size of a block, used to size the hash tables */
+#define TYPICAL_BLOCK_SIZE 4096
+
+typedef struct cache_entry {
+    uint64_t file_id;
+    uint64_t offset;
+    char *block;
+    size_t size;
+    /* LRU list of the shard, most recently used first */
+    struct cache_entry *prev;
+    struct cache_entry *next;
+    /* next entry in the same hash bucket */
+    struct cache_entry *chain;
+} cache_entry_t;
+
+typedef struct cache_shard {
+    pthread_mutex_t lock;
+    cache_entry_t **buckets;
+    size_t bucket_mask;
+    /* sentinel of the LRU list */
+    cache_entry_t lru;
+    size_t used;
+    size_t capacity;
+    uint64_t hits;
+    uint64_t misses;
+} cache_shard_t;
+
+/* static variables */
+static cache_shard_t shards[BLOCK_CACHE_SHARDS];
+
+/* static function prototypes */
+/* Returns the hash of the block. */
+static inline uint64_t hash_block(const uint64_t file_id,
+                                  const uint64_t offset);
+/* Returns the bucket of the block in its shard. */
+static inline cache_entry_t **find_bucket(cache_shard_t *shard,
+                                          const uint64_t hash);
+/* Unlinks the entry from the LRU list. */
+static inline void lru_remove(cache_entry_t *entry);
+/* Links the entry at the front of the LRU list. */
+static inline void lru_push_front(cache_shard_t *shard, cache_entry_t *entry);
+/* Removes the least recently used entry of the shard and frees it. */
+static void evict(cache_shard_t *shard);
+
+/* static functions */
+static inline uint64_t hash_block(const uint64_t file_id,
+                                  const uint64_t offset) {
+    uint64_t hash = (file_id * 0x9e3779b97f4a7c15ULL) ^ offset;
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+static inline cache_entry_t **find_bucket(cache_shard_t *shard,
+                                          const uint64_t hash) {
+    return &shard->buckets[(hash >> 4) & shard->bucket_mask];
+}
+
+static inline void lru_remove(cache_entry_t *entry) {
+    entry->prev->next = entry->next;
+    entry->next->prev = entry->prev;
+}
+
+static inline void lru_push_front(cache_shard_t *shard, cache_entry_t *entry) {
+    entry->prev = &shard->lru;
+    entry->next = shard->lru.next;
+    shard->lru.next->prev = entry;
+    shard->lru.next = entry;
+}
+
+static void evict(cache_shard_t *shard) {
+    cache_entry_t *victim = shard->lru.prev;
+    lru_remove(victim);
+    cache_entry_t **link =
+        find_bucket(shard, hash_block(victim->file_id, victim->offset));
+    while (*link != victim) {
+        link = &(*link)->chain;
+    }
+    *link = victim->chain;
+    shard->used -= victim->size;
+    free(victim->block);
+    free(victim);
+}
+
+/* extern functions */
+void block_cache_init(const size_t capacity) {
+    size_t shard_capacity = capacity / BLOCK_CACHE_SHARDS;
+    size_t bucket_count = 1;
+    while (bucket_count * TYPICAL_BLOCK_SIZE < shard_capacity) {
+        bucket_count <<= 1;
+    }
+    for (int i = 0; i < BLOCK_CACHE_SHARDS; i++) {
+        cache_shard_t *shard = &shards[i];
+        pthread_mutex_init(&shard->lock, NULL);
+        shard->buckets = safe_calloc(bucket_count, sizeof(cache_entry_t *));
+        shard->bucket_mask = bucket_count - 1;
+        shard->lru.prev = shard->lru.next = &shard->lru;
+        shard->used = 0;
+        shard->capacity = shard_capacity;
+        shard->hits = 0;
+        shard->misses = 0;
+    }
+}
+
+const char *block_cache_get(const uint64_t file_id, const uint64_t offset) {
+    uint64_t hash = hash_block(file_id, offset);
+    cache_shard_t *shard = &shards[hash & (BLOCK_CACHE_SHARDS - 1)];
+    const char *block = NULL;
+
+    pthread_mutex_lock(&shard->lock);
+    for (cache_entry_t *entry = *find_bucket(shard, hash); entry != NULL;
+         entry = entry->chain) {
+        if (entry->file_id == file_id && entry->offset == offset) {
+            lru_remove(entry);
+            lru_push_front(shard, entry);
+            block = entry->block;
+            break;
+        }
+    }
+    if (block != NULL) {
+        shard->hits++;
+    } else {
+        shard->misses++;
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return block;
+}
+
+const char *block_cache_put(const uint64_t file_id, const uint64_t offset,
+                            char *block, const size_t size) {
+    uint64_t hash = hash_block(file_id, offset);
+    cache_shard_t *shard = &shards[hash & (BLOCK_CACHE_SHARDS - 1)];
+    cache_entry_t *entry = safe_malloc(sizeof(cache_entry_t));
+    entry->file_id = file_id;
+    entry->offset = offset;
+    entry->block = block;
+    entry->size = size;
+
+    pthread_mutex_lock(&shard->lock);
+    /* Makes room for the block. A block larger than the whole shard still
+     * stays until the next insertion. */
+    while (shard->used > 0 && shard->used + size > shard->capacity) {
+        evict(shard);
+    }
+    cache_entry_t **bucket = find_bucket(shard, hash);
+    entry->chain = *bucket;
+    *bucket = entry;
+    lru_push_front(shard, entry);
+    shard->used += size;
+    pthread_mutex_unlock(&shard->lock);
+    return block;
+}
+
+void block_cache_stats(uint64_t *hits, uint64_t *misses) {
+    *hits = 0;
+    *misses = 0;
+    for (int i = 0; i < BLOCK_CACHE_SHARDS; i++) {
+        pthread_mutex_lock(&shards[i].lock);
+        *hits += shards[i].hits;
+        *misses += shards[i].misses;
+        pthread_mutex_unlock(&shards[i].lock);
+    }
+}
+
+void block_cache_free() {
+    for (int i = 0; i < BLOCK_CACHE_SHARDS; i++) {
+        cache_shard_t *shard = &shards[i];
+        while (shard->lru.next != &shard->lru) {
+            evict(shard);
+        }
+        free(shard->buckets);
+        shard->buckets = NULL;
+        pthread_mutex_destroy(&shard->lock);
+    }
+}
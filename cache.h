@@ -0,0 +1,30 @@
+#ifndef CACHE_H
+#define CACHE_H
+#include <stddef.h>
+#include <stdint.h>
+
+/* Budget of the block cache in bytes. It can be overridden at compile time,
+ * e.g. -DBLOCK_CACHE_SIZE=$((256 << 20)). */
+#ifndef BLOCK_CACHE_SIZE
+#define BLOCK_CACHE_SIZE (64 << 20)
+#endif
+/* The cache is split into shards, each with its own lock and LRU list, so
+ * that concurrent readers rarely contend. Must be a power of two. */
+#define BLOCK_CACHE_SHARDS 16
+
+/* Initializes an empty cache of at most capacity bytes. */
+void block_cache_init(const size_t capacity);
+/* Returns the block of the storage file starting at offset, or NULL if it is
+ * not cached. The block stays valid until the next block_cache_put(). */
+const char *block_cache_get(const uint64_t file_id, const uint64_t offset);
+/* Caches the block, which must have been allocated with malloc() and is freed
+ * by the cache, and evicts the least recently used blocks of the shard until
+ * it is within budget. Returns block. */
+const char *block_cache_put(const uint64_t file_id, const uint64_t offset,
+                            char *block, const size_t size);
+/* Reads the hit and miss counters. */
+void block_cache_stats(uint64_t *hits, uint64_t *misses);
+/* Frees every cached block. */
+void block_cache_free();
+
+#endif
@@ -6,6 +6,9 @@
 #include <string.h>
 #include <time.h>
 
+/* length of the generated values */
+#define VALUE_LENGTH 128
+
 int main(int argc, char *argv[]) {
     if (argc > 9) {
         fprintf(stderr, "Error: too many arguments\n");
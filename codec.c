@@ -0,0 +1,128 @@
+#include "codec.h"
+#include "definition.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+static const char alphabet[] = "0123456789"
+                               "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+                               "abcdefghijklmnopqrstuvwxyz";
+
+/* static function prototypes */
+/* Returns the 6-bit code of c, or -1 if c cannot be packed. */
+static inline int char_code(const unsigned char c);
+/* Returns true if every character of the value can be packed. */
+static bool is_packable(const char *value, const size_t length);
+/* Returns the number of bytes taken by length packed characters. */
+static inline size_t packed_size(const size_t length);
+/* Reads the header of the encoded value and returns its size. */
+static inline size_t read_header(const char *encoded, size_t *length,
+                                 bool *packed);
+
+/* static functions */
+static inline int char_code(const unsigned char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'A' && c <= 'Z') {
+        return c - 'A' + 10;
+    }
+    if (c >= 'a' && c <= 'z') {
+        return c - 'a' + 36;
+    }
+    return -1;
+}
+
+static bool is_packable(const char *value, const size_t length) {
+    for (size_t i = 0; i < length; i++) {
+        if (char_code(value[i]) == -1) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static inline size_t packed_size(const size_t length) {
+    return (length * 6 + 7) / 8;
+}
+
+static inline size_t read_header(const char *encoded, size_t *length,
+                                 bool *packed) {
+    const uint8_t *in = (const uint8_t *)encoded;
+    uint32_t header = 0;
+    size_t size = 0;
+    do {
+        header |= (uint32_t)(in[size] & 0x7f) << (7 * size);
+    } while (in[size++] & 0x80);
+    *length = header >> 1;
+    *packed = header & 1;
+    return size;
+}
+
+/* extern functions */
+size_t value_encode(char *dst, const char *value, const size_t length) {
+    bool packed = PACKED_VALUES && is_packable(value, length);
+
+    /* Writes the header */
+    uint8_t *out = (uint8_t *)dst;
+    uint32_t header = length << 1 | packed;
+    while (header >= 0x80) {
+        *out++ = (header & 0x7f) | 0x80;
+        header >>= 7;
+    }
+    *out++ = header;
+
+    if (!packed) {
+        if (length > 0) {
+            memcpy(out, value, length);
+        }
+        return out + length - (uint8_t *)dst;
+    }
+
+    uint32_t bits = 0;
+    int bit_count = 0;
+    for (size_t i = 0; i < length; i++) {
+        bits = bits << 6 | char_code(value[i]);
+        bit_count += 6;
+        if (bit_count >= 8) {
+            bit_count -= 8;
+            *out++ = bits >> bit_count;
+        }
+    }
+    if (bit_count > 0) {
+        *out++ = bits << (8 - bit_count);
+    }
+    return out - (uint8_t *)dst;
+}
+
+size_t value_decode(char *dst, const char *encoded) {
+    size_t length;
+    bool packed;
+    const uint8_t *in = (const uint8_t *)encoded;
+    in += read_header(encoded, &length, &packed);
+
+    if (!packed) {
+        memcpy(dst, in, length);
+        return length;
+    }
+
+    uint32_t bits = 0;
+    int bit_count = 0;
+    for (size_t i = 0; i < length; i++) {
+        if (bit_count < 6) {
+            bits = bits << 8 | *in++;
+            bit_count += 8;
+        }
+        bit_count -= 6;
+        dst[i] = alphabet[(bits >> bit_count) & 0x3f];
+    }
+    return length;
+}
+
+size_t value_encoded_size(const char *encoded) {
+    size_t length;
+    bool packed;
+    size_t header_size = read_header(encoded, &length, &packed);
+    return header_size + (packed ? packed_size(length) : length);
+}
@@ -0,0 +1,51 @@
+#ifndef CODEC_H
+#define CODEC_H
+#include "definition.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Values are stored in the B+ tree and in storage files in encoded form: a
+ * header followed by the payload. The header is a varint (7 bits per byte,
+ * least significant group first) of the value length shifted left by one,
+ * whose lowest bit tells how the payload is stored.
+ *
+ *   packed: every character of [0-9A-Za-z] takes 6 bits, so 4 characters fit
+ *           in 3 bytes.
+ *   raw:    the bytes of the value as they are.
+ *
+ * Values containing any other character fall back to raw. Compiling with
+ * -DPACKED_VALUES=0 stores every value raw.
+ *
+ * A value of length 0, which PUT never stores, is a tombstone: it marks a
+ * deleted key. */
+#ifndef PACKED_VALUES
+#define PACKED_VALUES 1
+#endif
+
+#if MAX_VALUE_LENGTH >= (1 << 20)
+#error "the header of an encoded value holds lengths below 2^20"
+#endif
+
+#define VALUE_HEADER_MAX_SIZE 3
+/* upper bound of the size of an encoded value */
+#define MAX_ENCODED_VALUE_SIZE (VALUE_HEADER_MAX_SIZE + MAX_VALUE_LENGTH)
+
+/* Encodes the value of the given length into dst and returns the encoded
+ * size. dst must hold MAX_ENCODED_VALUE_SIZE bytes. A length of 0 encodes a
+ * tombstone. */
+size_t value_encode(char *dst, const char *value, const size_t length);
+/* Decodes the encoded value into dst, which must hold MAX_VALUE_LENGTH bytes,
+ * and returns its length. */
+size_t value_decode(char *dst, const char *encoded);
+/* Returns the size of the encoded value. */
+size_t value_encoded_size(const char *encoded);
+
+/* Returns true if the encoded value is a tombstone. Its header is a single
+ * byte holding length 0, while the first header byte of any other value holds
+ * a non zero length or continues into the next byte. */
+static inline bool value_is_tombstone(const char *encoded) {
+    return ((uint8_t)encoded[0] >> 1) == 0;
+}
+
+#endif
@@ -1,100 +1,375 @@
 #include "database.h"
 #include "bloomfilter.h"
 #include "bptree.h"
+#include "cache.h"
+#include "codec.h"
 #include "definition.h"
+#include "output.h"
 #include "sorting.h"
+#include "sstable.h"
 #include "utils.h"
+#include "wal.h"
+#include <errno.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <time.h>
 
 /* macros */
-#define MAX_METADATA 200
 #define MAX_BUFFER_SIZE 2000000
+/* The PUT buffer is also flushed once its values take this many bytes, so
+ * that large values cannot grow it without bound. */
+#ifndef MAX_BUFFER_BYTES
+#define MAX_BUFFER_BYTES (256 << 20)
+#endif
+/* Compaction merges runs of adjacent files smaller than this many keys and
+ * bytes into files of at most this many keys and bytes, which still fit in
+ * the B+ tree when loaded. */
+#define COMPACTION_TARGET_KEYS MAX_BUFFER_SIZE
+#define COMPACTION_TARGET_BYTES MAX_BUFFER_BYTES
+/* While the database is idle, the flush thread compacts one run of files
+ * every this many microseconds until nothing is left to compact */
+#ifndef COMPACTION_INTERVAL_US
+#define COMPACTION_INTERVAL_US 100000
+#endif
+/* The B+ tree is saved at swaps. The flush thread also saves it if this many
+ * flushes went by without a swap, which bounds the rotated logs kept for the
+ * records of the tree. */
+#define CHECKPOINT_FLUSHES 4
+/* number of slots of the hash index of the PUT buffer, a power of two at
+ * least twice MAX_BUFFER_SIZE so that probe sequences stay short */
+#define PUT_INDEX_SIZE (1UL << (64 - __builtin_clzl(2 * MAX_BUFFER_SIZE - 1)))
+#define PUT_INDEX_EMPTY UINT32_MAX
+/* size of the chunks holding the values of a PUT buffer */
+#define ARENA_CHUNK_SIZE MAX(1 << 20, MAX_ENCODED_VALUE_SIZE)
+
+/* structures */
+/* Bump allocator for the values of a PUT buffer. Its chunks are kept for
+ * reuse once the buffer has been flushed. */
+typedef struct arena {
+    char **chunks;
+    size_t chunk_count;
+    /* index of the chunk being filled */
+    size_t current;
+    /* bytes used in the chunk being filled */
+    size_t used;
+    /* bytes allocated since the last reset */
+    size_t bytes;
+} arena_t;
+
+/* Output of a SCAN in progress. Records reach it in key order from the B+
+ * tree and the storage files, and the records of the PUT buffer in the range
+ * replace them. */
+typedef struct scan_state {
+    /* the next key to write, unless every key has been written */
+    uint64_t next_key;
+    uint64_t end_key;
+    bool done;
+    /* the latest record of every key of the PUT buffer in the range, sorted
+     * by key */
+    data_t *pending;
+    size_t pending_count;
+    size_t pending_idx;
+} scan_state_t;
+
+/* A key of a batch of GETs and its position in the batch */
+typedef struct lookup {
+    uint64_t key;
+    size_t idx;
+} lookup_t;
 
 /* static variables */
-static FILE *fp = NULL;
+static output_t output;
+static bool output_is_open = false;
 static const char *dir_path = "storage";
 static const char *meta_file_path = "storage/meta";
-static const char *empty_str = "EMPTY";
-static const char *newline = "\n";
+static const char *meta_tmp_file_path = "storage/meta.tmp";
 static bloomfilter_t bf;
 static char bf_file_path[MAX_PATH + 1];
+static wal_t wal;
+static char wal_file_path[MAX_PATH + 1];
 static bptree_t bptree;
-static metadata_t metatable[MAX_METADATA];
+/* sorted by start key; the key ranges of the files never overlap */
+static metadata_t *metatable = NULL;
 static size_t meta_count = 0;
+static size_t meta_capacity = 0;
+static size_t next_file_number = 0;
+/* files numbered below this may be referenced by the metatable on disk */
+static size_t persisted_file_limit = 0;
+/* index in the metatable where the next compaction starts looking */
+static size_t compaction_cursor = 0;
+/* storage files mapped for GET, indexed by file number */
+static sstable_t *tables = NULL;
+static size_t table_capacity = 0;
 static int32_t loaded_file = -1;
+/* files replaced during this session which the metatable on disk may still
+ * refer to. They are deleted once the metatable is saved, since crash
+ * recovery may still need them. */
+static size_t *obsolete_files = NULL;
+static size_t obsolete_count = 0;
+static size_t obsolete_capacity = 0;
+/* PUTs fill put_buf while the other buffer is being flushed in the
+ * background */
+static data_t *put_bufs[2];
 static data_t *put_buf;
 static size_t key_count = 0;
+/* values of put_bufs[i] are stored in put_arenas[i] */
+static arena_t put_arenas[2];
+static arena_t *put_arena;
+/* Open addressing hash index of put_buf: the position of the latest record of
+ * every key in put_buf, or PUT_INDEX_EMPTY. GETs read their own writes through
+ * it without flushing the buffer. */
+static uint32_t *put_index = NULL;
+/* values read from cached blocks by a batch of GETs, which have to outlive
+ * the blocks until the results are written */
+static arena_t get_arena;
+/* scratch buffer of the sort of a PUT buffer. Flushes and scans never sort at
+ * the same time, since a scan waits for the flush thread to be idle. */
+static data_t *sort_scratch = NULL;
+static pthread_t flush_thread;
+static pthread_mutex_t flush_lock = PTHREAD_MUTEX_INITIALIZER;
+/* measures the deadlines of idle compactions on the monotonic clock */
+static pthread_cond_t flush_cond;
+/* buffer handed to the flush thread, NULL when the thread is idle. The B+
+ * tree, the metatable and the storage files belong to the flush thread
+ * while it is not NULL. */
+static data_t *flushing_buf = NULL;
+static size_t flushing_count = 0;
+static arena_t *flushing_arena = NULL;
+static bool stop_flush_thread = false;
+/* set while the flush thread compacts storage files. The foreground shares
+ * the metatable and the storage files with it then, and reads them while
+ * holding meta_lock, which the compaction takes only to open its inputs and to
+ * replace them. */
+static bool compacting = false;
+/* set once the foreground leaves the B+ tree and the metatable to the flush
+ * thread, which may compact while idle from then on */
+static bool idle_compaction = false;
+static pthread_mutex_t meta_lock = PTHREAD_MUTEX_INITIALIZER;
+/* set while the log is replayed at startup, when the log must not rotate */
+static bool recovering = false;
+/* sequence number of the rotated log holding the records of flushing_buf */
+static uint64_t flushing_seq = 0;
+/* the rotated logs numbered below this hold only records which the metatable
+ * on disk refers to, since the whole B+ tree was saved after they were
+ * flushed */
+static uint64_t saved_seq = 0;
 static uint64_t min_key = UINT64_MAX;
 static uint64_t max_key = 0;
-static bool first_line = true;
 
 /* static function prototypes */
 static void close();
 static void set_output_filename(const char *filename);
-static void put(const uint64_t key, char *value);
+static void put(const uint64_t key, const char *value, const size_t length);
+static void del(const uint64_t key);
+/* Adds key-value to the PUT buffer without logging it. A length of 0 adds a
+ * tombstone. */
+static void buffer_put(const uint64_t key, const char *value,
+                       const size_t length);
 static void get(const uint64_t key);
+static void get_batch(const uint64_t keys[], const size_t count);
+/* Copies an encoded value found by a batch of GETs to get_arena. */
+static const char *keep_value(const char *value);
+/* Orders lookups by key, and by position for equal keys. */
+static int compare_lookups(const void *a, const void *b);
 static void scan(const uint64_t start_key, const uint64_t end_key);
 static void load_metatable();
 static void save_metatable();
-/* Saves the first half of the buffer to the file and loads the file found from
- * the metatable. */
-static void swap_files(metadata_t *metadata);
-static void sort_put_buffer(const int32_t start, const int32_t end);
-/* Flushes the PUT buffer by inserting the data into B+ tree. */
+/* Stores metadata in the metatable, replacing the entry of the same file if
+ * any, and keeps the metatable sorted by start key. */
+static void update_metatable(const metadata_t *metadata);
+/* Removes the entry of the file from the metatable if any. */
+static void remove_metadata(const size_t file_number);
+/* Returns the number of files whose start key is less than or equal to key. */
+static size_t count_files_before(const uint64_t key);
+/* Returns the file whose key range covers key, or NULL if there is none. */
+static metadata_t *find_file(const uint64_t key);
+/* Saves the B+ tree to a new file which replaces the loaded file. */
+static void save_bptree();
+/* Saves the B+ tree and the metatable, so that the records flushed before
+ * flushing_buf are no longer needed in the log once the bloom filter is saved
+ * too. */
+static void checkpoint();
+/* Returns the storage file of the given file number, opening it on first use.
+ */
+static sstable_t *get_table(const size_t file_number);
+/* Closes the storage file of the given file number before it is rewritten. */
+static void release_table(const size_t file_number);
+/* Checkpoints and loads the file found from the metatable. */
+static void swap_files(const metadata_t *metadata);
+/* Deletes a file which is no longer in the metatable, or schedules it to be
+ * deleted once the metatable is saved if crash recovery may need it. */
+static void retire_file(const size_t file_number);
+/* Deletes the files replaced during this session. */
+static void delete_obsolete_files();
+/* Sorts the records of a PUT buffer by key and keeps the latest record of
+ * every key. Returns the number of records left. */
+static size_t sort_put_buffer(data_t buf[], const size_t count);
+/* Returns the slot of the hash index where key is or would be stored. */
+static size_t put_index_slot(const uint64_t key);
+/* Returns the latest record of key in put_buf, or NULL if there is none. */
+static const data_t *put_index_find(const uint64_t key);
+/* Empties put_buf and its hash index. */
+static void reset_put_buffer();
+/* Inserts the data in buf into B+ tree. */
+static void flush_buffer(data_t buf[], const size_t count);
+/* Merges one run of adjacent small files into a single file. Returns false if
+ * there is nothing to compact. */
+static bool compact_step();
+/* Returns true if the idx-th file in the metatable may be compacted. */
+static bool is_compactable(const size_t idx);
+/* Returns the size of the file of the given number. */
+static uint64_t file_size(const size_t file_number);
+/* Replaces the first-th to the last-th files in the metatable by a file
+ * holding all of their records. */
+static void merge_files(const size_t first, const size_t last);
+/* Runs one compaction step without holding flush_lock, so that foreground
+ * work proceeds meanwhile. The caller holds flush_lock. Returns false if there
+ * is nothing to compact. */
+static bool compact_unlocked();
+/* Flushes buffers handed over by PUTs until the database is closed, and
+ * compacts after every flush and while idle. */
+static void *flush_worker(void *arg);
+/* Waits until the flush thread has flushed the buffer handed over to it. */
+static void wait_for_flush();
+/* Waits until the flush thread is idle, compaction included. */
+static void wait_for_worker();
+/* Hands put_buf over to the flush thread. */
+static void hand_over_put_buffer();
+/* Hands the full PUT buffer over to the flush thread and switches to the
+ * other buffer. Blocks only while the other buffer is still being flushed. */
+static void flush_in_background();
+/* Flushes both PUT buffers by inserting the data into B+ tree. */
 static void flush_put_buffer();
+/* Collects the latest record of every key of the PUT buffer in the range of
+ * the scan. */
+static void scan_collect_pending(scan_state_t *state);
+/* Writes the records of the PUT buffer below key, then the record of key:
+ * the one of the PUT buffer if any, otherwise the encoded value. */
+static void scan_write(scan_state_t *state, const uint64_t key,
+                       const char *value);
+/* Writes the rest of the PUT buffer and EMPTY up to the end of the scan. */
+static void scan_finish(scan_state_t *state);
+/* Writes EMPTY for the keys of the scan below key, then marks key as
+ * written. */
+static void scan_advance(scan_state_t *state, const uint64_t key);
+/* Writes the next record of the PUT buffer. */
+static void scan_write_pending(scan_state_t *state);
+/* Writes EMPTY for every key from first to last. */
+static void write_empty_range(const uint64_t first, const uint64_t last);
+/* Decodes the value and writes it to the output file, or writes EMPTY if the
+ * value is a tombstone. */
+static void write_value(const char *value);
+/* Writes the value of a record of the PUT buffer, or EMPTY if the record is a
+ * tombstone. */
+static void write_record(const data_t *record);
+/* Returns size bytes from the arena, which must not exceed
+ * ARENA_CHUNK_SIZE. */
+static char *arena_alloc(arena_t *arena, const size_t size);
+/* Makes all the chunks of the arena available again. */
+static void arena_reset(arena_t *arena);
+/* Frees the chunks of the arena. */
+static void arena_free(arena_t *arena);
 
 /* static functions */
 static void close() {
     puts("closing database ...");
 
-    bf.save(bf_file_path);
-    bf.free();
-
-    /* Flushes the buffer to B+ tree */
+    /* Flushes the buffers to B+ tree */
     flush_put_buffer();
+    pthread_mutex_lock(&flush_lock);
+    stop_flush_thread = true;
+    pthread_cond_signal(&flush_cond);
+    pthread_mutex_unlock(&flush_lock);
+    pthread_join(flush_thread, NULL);
+    pthread_cond_destroy(&flush_cond);
 
     /* Saves B+ tree */
-    if (!bptree.is_empty()) {
-        char filepath[MAX_PATH + 1];
-        size_t file_number = (loaded_file == -1) ? meta_count++ : loaded_file;
-        metatable[file_number].file_number = file_number;
-        snprintf(filepath, MAX_PATH, "%s/%lu", dir_path, file_number);
-        bptree.save(&metatable[file_number], filepath);
-    }
+    save_bptree();
     bptree.free_memory();
+    for (int i = 0; i < table_capacity; i++) {
+        release_table(i);
+    }
+    free(tables);
+    uint64_t hits, misses;
+    block_cache_stats(&hits, &misses);
+    printf("block cache: %lu hits, %lu misses\n", hits, misses);
+    block_cache_free();
 
     save_metatable();
+    free(metatable);
+
+    bf.save();
+    bf.free();
+
+    /* Everything in the log has been persisted */
+    wal.clear();
+    wal.close();
+    delete_obsolete_files();
 
-    for (int i = 0; i < MAX_BUFFER_SIZE; i++) {
-        free(put_buf[i].value);
+    for (int i = 0; i < 2; i++) {
+        free(put_bufs[i]);
+        arena_free(&put_arenas[i]);
     }
-    free(put_buf);
+    arena_free(&get_arena);
+    free(put_index);
+    free(sort_scratch);
 
-    if (fp != NULL)
-        fclose(fp);
+    if (output_is_open) {
+        output.close();
+    }
 }
 
 static void set_output_filename(const char *filename) {
-    fp = safe_fopen(filename, "wb");
+    init_output(&output);
+    output.open(filename);
+    output_is_open = true;
 }
 
-static void put(const uint64_t key, char *value) {
-    bf.add(key);
+static void put(const uint64_t key, const char *value, const size_t length) {
+    if (length == 0 || length > MAX_VALUE_LENGTH) {
+        fprintf(stderr, "Error: value of key %lu must be 1 to %d bytes long\n",
+                key, MAX_VALUE_LENGTH);
+        return;
+    }
+    wal.append(key, value, length);
+    buffer_put(key, value, length);
+}
 
-    /* Adds key-value to the buffer */
+static void del(const uint64_t key) {
+    /* A key the bloom filter has never seen has nothing to delete */
+    if (bf.lookup(key) == -1) {
+        return;
+    }
+    wal.append(key, NULL, 0);
+    buffer_put(key, NULL, 0);
+}
+
+static void buffer_put(const uint64_t key, const char *value,
+                       const size_t length) {
+    /* Adds key-value to the buffer. A tombstone has no value, and its key is
+     * in the bloom filter already. */
     put_buf[key_count].key = key;
-    strncpy(put_buf[key_count].value, value, VALUE_LENGTH);
+    put_buf[key_count].length = length;
+    if (length == 0) {
+        put_buf[key_count].value = NULL;
+    } else {
+        bf.add(key);
+        put_buf[key_count].value = arena_alloc(put_arena, length);
+        memcpy(put_buf[key_count].value, value, length);
+    }
+    /* The latest record of the key wins */
+    put_index[put_index_slot(key)] = key_count;
     key_count++;
 
-    if (key_count < MAX_BUFFER_SIZE) {
+    if (key_count < MAX_BUFFER_SIZE && put_arena->bytes < MAX_BUFFER_BYTES) {
         return;
     }
 
-    flush_put_buffer();
+    flush_in_background();
 }
 
 static void get(const uint64_t key) {
@@ -102,167 +377,212 @@ static void get(const uint64_t key) {
     /* Not found */
     if (result == -1) {
         /* Writes to output file */
-        if (first_line) {
-            first_line = false;
-        } else {
-            safe_fwrite(newline, sizeof(char), 1, fp);
-        }
-        safe_fwrite(empty_str, sizeof(char), strlen(empty_str), fp);
+        output.write_empty(1);
         return;
     }
 
-    flush_put_buffer();
+    /* Reads the latest write from the PUT buffer if any */
+    const data_t *record = put_index_find(key);
+    if (record != NULL) {
+        write_record(record);
+        return;
+    }
+    /* Otherwise the buffer being flushed has to reach the B+ tree first,
+     * since it is sorted in place and the B+ tree, the metatable and the
+     * storage files belong to the flush thread until then */
+    wait_for_flush();
 
     /* Not in current B+ tree */
     if (key < min_key || key > max_key) {
         /* Looks up the metatable */
+        pthread_mutex_lock(&meta_lock);
+        metadata_t *file = find_file(key);
         bool found = false;
-        for (int i = 0; i < meta_count; i++) {
-            found =
-                (key >= metatable[i].start_key && key <= metatable[i].end_key);
-            if (found) {
-                /* Reads the file without swapping files */
-                static char path[MAX_PATH + 1];
-                snprintf(path, MAX_PATH, "storage/%lu",
-                         metatable[i].file_number);
-                FILE *file = safe_fopen(path, "rb");
-                uint64_t tmp_key;
-                static char tmp_value[VALUE_LENGTH + 1];
-                for (int j = 0; j < metatable[i].total_keys; j++) {
-                    safe_fread(&tmp_key, sizeof(uint64_t), 1, file);
-                    safe_fread(tmp_value, sizeof(char), VALUE_LENGTH + 1, file);
-                    if (tmp_key >= key) {
-                        /* Identical key found */
-                        if (tmp_key == key) {
-                            if (first_line) {
-                                first_line = false;
-                            } else {
-                                safe_fwrite(newline, sizeof(char), 1, fp);
-                            }
-                            safe_fwrite(tmp_value, sizeof(char), VALUE_LENGTH,
-                                        fp);
-                        } else {
-                            found = false;
-                        }
-                        break;
-                    }
-                }
-                fclose(file);
-                break;
+        if (file != NULL) {
+            /* Reads one block of the file without swapping files */
+            sstable_t *table = get_table(file->file_number);
+            const char *value = sstable_get(table, key);
+            if (value != NULL) {
+                found = true;
+                write_value(value);
             }
         }
+        pthread_mutex_unlock(&meta_lock);
         if (!found) {
-            if (first_line) {
-                first_line = false;
-            } else {
-                safe_fwrite(newline, sizeof(char), 1, fp);
-            }
-            safe_fwrite(empty_str, sizeof(char), strlen(empty_str), fp);
+            output.write_empty(1);
         }
         return;
     }
 
     /* Writes the result to output file */
-    if (first_line) {
-        first_line = false;
-    } else {
-        safe_fwrite(newline, sizeof(char), 1, fp);
-    }
     const char *value = bptree.search(key);
     if (value == NULL) {
-        safe_fwrite(empty_str, sizeof(char), strlen(empty_str), fp);
+        output.write_empty(1);
     } else {
-        safe_fwrite(value, sizeof(char), VALUE_LENGTH, fp);
+        write_value(value);
     }
 }
 
-static void scan(const uint64_t start_key, const uint64_t end_key) {
-    flush_put_buffer();
+static void get_batch(const uint64_t keys[], const size_t count) {
+    const char **values = safe_malloc(count * sizeof(char *));
+    const data_t **records = safe_malloc(count * sizeof(data_t *));
+    lookup_t *lookups = safe_malloc(count * sizeof(lookup_t));
+    size_t lookup_count = 0;
+    for (size_t i = 0; i < count; i++) {
+        values[i] = NULL;
+        records[i] = NULL;
+        /* Keys rejected by the bloom filter are not looked up, and keys
+         * written to the PUT buffer are answered from it */
+        if (bf.lookup(keys[i]) == 0 &&
+            (records[i] = put_index_find(keys[i])) == NULL) {
+            lookups[lookup_count].key = keys[i];
+            lookups[lookup_count].idx = i;
+            lookup_count++;
+        }
+    }
 
-    char **ptrs = safe_malloc((end_key - start_key + 1) * sizeof(char *));
-    for (uint64_t key = start_key; key <= end_key;) {
-        /* Not in current B+ tree */
-        if (key < min_key || key > max_key) {
-            /* Looks up the metatable */
-            bool found = false;
-            for (int i = 0; i < meta_count; i++) {
-                found = (key >= metatable[i].start_key &&
-                         key <= metatable[i].end_key);
-                if (found) {
-                    swap_files(&metatable[i]);
-                    min_key = metatable[i].start_key;
-                    max_key = metatable[i].end_key;
-
-                    /* Sets ptrs */
-                    uint64_t _end_key = MIN(end_key, max_key);
-                    size_t size = _end_key - key + 1;
-                    memset(ptrs, 0, size * sizeof(char *));
-                    bptree.scan(ptrs, key, _end_key);
-
-                    /* Writes ptrs to output file */
-                    for (int j = 0; j < size; j++) {
-                        if (first_line) {
-                            first_line = false;
-                        } else {
-                            safe_fwrite(newline, sizeof(char), 1, fp);
-                        }
-                        if (ptrs[j] == NULL) {
-                            safe_fwrite(empty_str, sizeof(char),
-                                        strlen(empty_str), fp);
-                        } else {
-                            safe_fwrite(ptrs[j], sizeof(char), VALUE_LENGTH,
-                                        fp);
-                        }
-                    }
-                    key = _end_key + 1;
-                    break;
-                }
+    if (lookup_count > 0) {
+        wait_for_flush();
+        qsort(lookups, lookup_count, sizeof(lookup_t), compare_lookups);
+
+        /* Resolves the keys in increasing order, each file in one pass */
+        uint64_t *sorted_keys = safe_malloc(lookup_count * sizeof(uint64_t));
+        const char **found = safe_malloc(lookup_count * sizeof(char *));
+        for (size_t i = 0; i < lookup_count; i++) {
+            sorted_keys[i] = lookups[i].key;
+        }
+        pthread_mutex_lock(&meta_lock);
+        for (size_t i = 0; i < lookup_count;) {
+            uint64_t key = sorted_keys[i];
+            if (key >= min_key && key <= max_key) {
+                values[lookups[i].idx] = bptree.search(key);
+                i++;
+                continue;
             }
-            if (!found) {
-                if (first_line) {
-                    first_line = false;
-                } else {
-                    safe_fwrite(newline, sizeof(char), 1, fp);
-                }
-                safe_fwrite(empty_str, sizeof(char), strlen(empty_str), fp);
-                key++;
+            metadata_t *file = find_file(key);
+            if (file == NULL) {
+                i++;
                 continue;
             }
+            /* The keys of the file; none of them is in the B+ tree, whose
+             * range only covers the loaded file */
+            size_t last = i + 1;
+            while (last < lookup_count && sorted_keys[last] <= file->end_key) {
+                last++;
+            }
+            sstable_get_sorted(get_table(file->file_number), &sorted_keys[i],
+                               last - i, &found[i], keep_value);
+            for (size_t j = i; j < last; j++) {
+                values[lookups[j].idx] = found[j];
+            }
+            i = last;
+        }
+        pthread_mutex_unlock(&meta_lock);
+        free(sorted_keys);
+        free(found);
+    }
+
+    /* Writes the results in the order of the GETs */
+    for (size_t i = 0; i < count; i++) {
+        if (records[i] != NULL) {
+            write_record(records[i]);
+        } else if (values[i] == NULL) {
+            output.write_empty(1);
         } else {
-            /* Sets ptrs */
-            uint64_t _end_key = MIN(end_key, max_key);
-            size_t size = _end_key - key + 1;
-            memset(ptrs, 0, size * sizeof(char *));
-            bptree.scan(ptrs, key, _end_key);
-
-            /* Writes ptrs to output file */
-            for (int i = 0; i < size; i++) {
-                if (first_line) {
-                    first_line = false;
-                } else {
-                    safe_fwrite(newline, sizeof(char), 1, fp);
-                }
-                if (ptrs[i] == NULL) {
-                    safe_fwrite(empty_str, sizeof(char), strlen(empty_str), fp);
-                } else {
-                    safe_fwrite(ptrs[i], sizeof(char), VALUE_LENGTH, fp);
-                }
+            write_value(values[i]);
+        }
+    }
+    free(values);
+    free(records);
+    free(lookups);
+    arena_reset(&get_arena);
+}
+
+static const char *keep_value(const char *value) {
+    size_t size = value_encoded_size(value);
+    char *copy = arena_alloc(&get_arena, size);
+    memcpy(copy, value, size);
+    return copy;
+}
+
+static int compare_lookups(const void *a, const void *b) {
+    const lookup_t *x = a, *y = b;
+    if (x->key != y->key) {
+        return (x->key < y->key) ? -1 : 1;
+    }
+    return (x->idx < y->idx) ? -1 : (x->idx > y->idx);
+}
+
+static void scan(const uint64_t start_key, const uint64_t end_key) {
+    /* The B+ tree, the metatable and the storage files belong to the flush
+     * thread until it has flushed its buffer, and are shared with compaction
+     * afterwards */
+    wait_for_flush();
+    pthread_mutex_lock(&meta_lock);
+
+    scan_state_t state = {start_key, end_key, false, NULL, 0, 0};
+    scan_collect_pending(&state);
+
+    /* The B+ tree, the storage files and the gaps between them cover
+     * adjacent key ranges, which are read one after another. Streams the
+     * results in key order, so memory does not depend on the width of the
+     * range. */
+    uint64_t key = start_key;
+    while (true) {
+        uint64_t range_end;
+        uint64_t next_key;
+        const char *value;
+        metadata_t *file;
+        if (key >= min_key && key <= max_key) {
+            /* Walks the leaves of the B+ tree from key */
+            range_end = MIN(end_key, max_key);
+            bptree_cursor_t cursor;
+            bptree.seek(&cursor, key);
+            while (bptree.next(&cursor, &next_key, &value) &&
+                   next_key <= range_end) {
+                scan_write(&state, next_key, value);
+            }
+        } else if ((file = find_file(key)) != NULL) {
+            /* Reads the storage file in place. The loaded file is never
+             * found, since its key range is part of the range of the B+
+             * tree. */
+            range_end = MIN(end_key, file->end_key);
+            sstable_iter_t iter;
+            sstable_iter_seek(&iter, get_table(file->file_number), key);
+            while (sstable_iter_next(&iter, &next_key, &value) &&
+                   next_key <= range_end) {
+                scan_write(&state, next_key, value);
+            }
+        } else {
+            /* Nothing is stored up to the next file or the B+ tree */
+            range_end = end_key;
+            size_t idx = count_files_before(key);
+            if (idx < meta_count) {
+                range_end = MIN(range_end, metatable[idx].start_key - 1);
             }
-            key = _end_key + 1;
+            if (min_key <= max_key && key < min_key) {
+                range_end = MIN(range_end, min_key - 1);
+            }
+        }
+        if (range_end == end_key) {
+            break;
         }
+        key = range_end + 1;
     }
-    free(ptrs);
+    pthread_mutex_unlock(&meta_lock);
+    scan_finish(&state);
 }
 
 static void load_metatable() {
     puts("loading metatable ...");
     FILE *file = safe_fopen(meta_file_path, "rb");
-    metadata_t *ptr = metatable;
-    while (fread(ptr, sizeof(metadata_t), 1, file) == 1) {
-        meta_count++;
-        ptr++;
+    metadata_t metadata;
+    while (fread(&metadata, sizeof(metadata_t), 1, file) == 1) {
+        update_metatable(&metadata);
+        next_file_number = MAX(next_file_number, metadata.file_number + 1);
     }
     fclose(file);
+    persisted_file_limit = next_file_number;
 
     DEBUG(for (int i = 0; i < meta_count; i++) {
         printf("file_number: %lu, start: %lu, end: %lu, total_keys: %lu\n",
@@ -273,23 +593,136 @@ static void load_metatable() {
 
 static void save_metatable() {
     puts("saving metatable ...");
-    FILE *file = safe_fopen(meta_file_path, "wb");
-    safe_fwrite(metatable, sizeof(metadata_t), meta_count, file);
-    fclose(file);
+    FILE *file = safe_fopen(meta_tmp_file_path, "wb");
+    /* An empty metatable has not been allocated yet */
+    if (meta_count > 0) {
+        safe_fwrite(metatable, sizeof(metadata_t), meta_count, file);
+    }
+    safe_commit_file(file, meta_tmp_file_path, meta_file_path);
+}
+
+static void update_metatable(const metadata_t *metadata) {
+    /* Removes the previous entry of the file */
+    remove_metadata(metadata->file_number);
+
+    if (meta_count == meta_capacity) {
+        meta_capacity = (meta_capacity == 0) ? 64 : meta_capacity << 1;
+        metatable = realloc(metatable, meta_capacity * sizeof(metadata_t));
+        if (metatable == NULL) {
+            fprintf(stderr, "Error: failed to allocate memory\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    size_t idx = count_files_before(metadata->start_key);
+    memmove(&metatable[idx + 1], &metatable[idx],
+            (meta_count - idx) * sizeof(metadata_t));
+    metatable[idx] = *metadata;
+    meta_count++;
+}
+
+static void remove_metadata(const size_t file_number) {
+    for (size_t i = 0; i < meta_count; i++) {
+        if (metatable[i].file_number == file_number) {
+            memmove(&metatable[i], &metatable[i + 1],
+                    (meta_count - i - 1) * sizeof(metadata_t));
+            meta_count--;
+            return;
+        }
+    }
+}
+
+static size_t count_files_before(const uint64_t key) {
+    size_t lo = 0, hi = meta_count;
+    while (lo < hi) {
+        size_t mid = (lo + hi) >> 1;
+        if (metatable[mid].start_key <= key) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static metadata_t *find_file(const uint64_t key) {
+    size_t idx = count_files_before(key);
+    if (idx == 0 || key > metatable[idx - 1].end_key) {
+        return NULL;
+    }
+    return &metatable[idx - 1];
+}
+
+static void save_bptree() {
+    if (bptree.is_empty()) {
+        return;
+    }
+
+    /* The loaded file is not overwritten, since the metatable on disk refers
+     * to it with its old key range until the metatable is saved */
+    char filepath[MAX_PATH + 1];
+    metadata_t metadata;
+    metadata.file_number = next_file_number++;
+    snprintf(filepath, MAX_PATH, "%s/%lu", dir_path, metadata.file_number);
+    bptree.save(&metadata, filepath);
+    if (loaded_file != -1) {
+        remove_metadata(loaded_file);
+        retire_file(loaded_file);
+        loaded_file = -1;
+    }
+    update_metatable(&metadata);
 }
 
-static void swap_files(metadata_t *metadata) {
+static sstable_t *get_table(const size_t file_number) {
+    if (file_number >= table_capacity) {
+        size_t capacity = MAX(64, table_capacity);
+        while (capacity <= file_number) {
+            capacity <<= 1;
+        }
+        tables = realloc(tables, capacity * sizeof(sstable_t));
+        if (tables == NULL) {
+            fprintf(stderr, "Error: failed to allocate memory\n");
+            exit(EXIT_FAILURE);
+        }
+        memset(&tables[table_capacity], 0,
+               (capacity - table_capacity) * sizeof(sstable_t));
+        table_capacity = capacity;
+    }
+
+    sstable_t *table = &tables[file_number];
+    if (table->data == NULL) {
+        static char path[MAX_PATH + 1];
+        snprintf(path, MAX_PATH, "%s/%lu", dir_path, file_number);
+        sstable_open(table, path);
+    }
+    return table;
+}
+
+static void release_table(const size_t file_number) {
+    if (file_number < table_capacity && tables[file_number].data != NULL) {
+        sstable_close(&tables[file_number]);
+    }
+}
+
+static void checkpoint() {
+    save_bptree();
+    min_key = UINT64_MAX;
+    max_key = 0;
+
+    save_metatable();
+    /* The metatable on disk refers to no file retired so far */
+    persisted_file_limit = next_file_number;
+    delete_obsolete_files();
+    saved_seq = flushing_seq;
+}
+
+static void swap_files(const metadata_t *metadata) {
     printf("swapping to file %lu ...\n", metadata->file_number);
 
     static char filepath[MAX_PATH + 1];
 
-    /* Saves B+ tree */
-    if (!bptree.is_empty()) {
-        size_t file_number = (loaded_file == -1) ? meta_count++ : loaded_file;
-        metatable[file_number].file_number = file_number;
-        snprintf(filepath, MAX_PATH, "%s/%lu", dir_path, file_number);
-        bptree.save(&metatable[file_number], filepath);
-    }
+    /* Saves B+ tree and the metatable */
+    checkpoint();
 
     /* Loads B+ tree */
     snprintf(filepath, MAX_PATH, "%s/%lu", dir_path, metadata->file_number);
@@ -298,88 +731,263 @@ static void swap_files(metadata_t *metadata) {
     loaded_file = metadata->file_number;
 }
 
-static void sort_put_buffer(const int32_t start, const int32_t end) {
-    if (end - start <= 1) {
+static void retire_file(const size_t file_number) {
+    release_table(file_number);
+
+    /* Files created in this session are not needed for crash recovery */
+    if (file_number >= persisted_file_limit) {
+        char filepath[MAX_PATH + 1];
+        snprintf(filepath, MAX_PATH, "%s/%lu", dir_path, file_number);
+        remove(filepath);
         return;
     }
-    /* stable sort */
-    mergesort(put_buf, start, end);
+
+    if (obsolete_count == obsolete_capacity) {
+        obsolete_capacity =
+            (obsolete_capacity == 0) ? 16 : obsolete_capacity << 1;
+        obsolete_files =
+            realloc(obsolete_files, obsolete_capacity * sizeof(size_t));
+        if (obsolete_files == NULL) {
+            fprintf(stderr, "Error: failed to allocate memory\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    obsolete_files[obsolete_count++] = file_number;
+}
+
+static void delete_obsolete_files() {
+    char filepath[MAX_PATH + 1];
+    for (size_t i = 0; i < obsolete_count; i++) {
+        snprintf(filepath, MAX_PATH, "%s/%lu", dir_path, obsolete_files[i]);
+        remove(filepath);
+    }
+    free(obsolete_files);
+    obsolete_files = NULL;
+    obsolete_count = obsolete_capacity = 0;
+}
+
+static size_t sort_put_buffer(data_t buf[], const size_t count) {
+    return radix_sort(buf, sort_scratch, count);
 }
 
 static void flush_put_buffer() {
-    DEBUG(printf("keys in buffer: %lu\n", key_count);)
+    /* The flush thread flushes put_buf too, since it may compact at any
+     * time */
+    wait_for_flush();
+    hand_over_put_buffer();
+    wait_for_worker();
+    reset_put_buffer();
+}
+
+static size_t put_index_slot(const uint64_t key) {
+    /* Mixes the key (splitmix64 finalizer) and probes linearly */
+    uint64_t h = key;
+    h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+    h ^= h >> 31;
+    size_t slot = h & (PUT_INDEX_SIZE - 1);
+    while (put_index[slot] != PUT_INDEX_EMPTY &&
+           put_buf[put_index[slot]].key != key) {
+        slot = (slot + 1) & (PUT_INDEX_SIZE - 1);
+    }
+    return slot;
+}
 
-    if (key_count == 0) {
+static const data_t *put_index_find(const uint64_t key) {
+    uint32_t pos = put_index[put_index_slot(key)];
+    return (pos == PUT_INDEX_EMPTY) ? NULL : &put_buf[pos];
+}
+
+static void reset_put_buffer() {
+    memset(put_index, 0xff, PUT_INDEX_SIZE * sizeof(uint32_t));
+    key_count = 0;
+}
+
+static void scan_collect_pending(scan_state_t *state) {
+    size_t count = 0;
+    for (size_t i = 0; i < key_count; i++) {
+        count += (put_buf[i].key >= state->next_key &&
+                  put_buf[i].key <= state->end_key);
+    }
+    if (count == 0) {
         return;
     }
 
-    sort_put_buffer(0, key_count - 1);
+    data_t *pending = safe_malloc(count * sizeof(data_t));
+    count = 0;
+    for (size_t i = 0; i < key_count; i++) {
+        if (put_buf[i].key >= state->next_key &&
+            put_buf[i].key <= state->end_key) {
+            pending[count++] = put_buf[i];
+        }
+    }
+    state->pending = pending;
+    state->pending_count = sort_put_buffer(pending, count);
+}
 
-    uint64_t key;
-    char *value;
-    for (int i = 0; i < key_count; i++) {
-        key = put_buf[i].key;
-        value = put_buf[i].value;
+static void scan_write(scan_state_t *state, const uint64_t key,
+                       const char *value) {
+    while (state->pending_idx < state->pending_count &&
+           state->pending[state->pending_idx].key < key) {
+        scan_write_pending(state);
+    }
+    if (state->pending_idx < state->pending_count &&
+        state->pending[state->pending_idx].key == key) {
+        scan_write_pending(state);
+        return;
+    }
+    scan_advance(state, key);
+    write_value(value);
+}
 
-        /* Flushes the B+ tree */
-        if (bptree.is_full()) {
-            /* Splits B+ tree into two parts and saves one of them depending on
-             * the current key */
-            char file[MAX_PATH + 1];
-            size_t file_number =
-                (loaded_file == -1) ? meta_count++ : loaded_file;
-            metatable[file_number].file_number = file_number;
-            snprintf(file, MAX_PATH, "%s/%lu", dir_path, file_number);
-            bptree.split_and_save_one(&metatable[file_number], file, key);
-            loaded_file = -1;
-            min_key = bptree.get_min_key();
-            max_key = bptree.get_max_key();
-            DEBUG(printf("min_key: %lu, max_key: %lu\n", min_key, max_key);)
+static void scan_finish(scan_state_t *state) {
+    while (state->pending_idx < state->pending_count) {
+        scan_write_pending(state);
+    }
+    if (!state->done) {
+        write_empty_range(state->next_key, state->end_key);
+    }
+    free(state->pending);
+}
+
+static void scan_advance(scan_state_t *state, const uint64_t key) {
+    if (key > state->next_key) {
+        write_empty_range(state->next_key, key - 1);
+    }
+    /* Stops at the end key rather than past it, which may not fit in 64
+     * bits */
+    state->done = (key == state->end_key);
+    state->next_key = key + 1;
+}
+
+static void scan_write_pending(scan_state_t *state) {
+    const data_t *record = &state->pending[state->pending_idx++];
+    scan_advance(state, record->key);
+    if (record->length == 0) {
+        output.write_empty(1);
+    } else {
+        output.write_value(record->value, record->length);
+    }
+}
+
+static void write_empty_range(const uint64_t first, const uint64_t last) {
+    /* Counts last - first + 1 in two parts, since the whole key space does
+     * not fit in 64 bits */
+    output.write_empty(last - first);
+    output.write_empty(1);
+}
+
+static void write_value(const char *value) {
+    if (value_is_tombstone(value)) {
+        output.write_empty(1);
+        return;
+    }
+    static char decoded[MAX_VALUE_LENGTH];
+    size_t length = value_decode(decoded, value);
+    output.write_value(decoded, length);
+}
+
+static void write_record(const data_t *record) {
+    if (record->length == 0) {
+        output.write_empty(1);
+    } else {
+        output.write_value(record->value, record->length);
+    }
+}
+
+static char *arena_alloc(arena_t *arena, const size_t size) {
+    if (arena->chunk_count == 0 || arena->used + size > ARENA_CHUNK_SIZE) {
+        /* Moves on to the next chunk */
+        if (arena->chunk_count > 0) {
+            arena->current++;
         }
+        if (arena->current == arena->chunk_count) {
+            size_t chunks_size = (arena->chunk_count + 1) * sizeof(char *);
+            arena->chunks = realloc(arena->chunks, chunks_size);
+            if (arena->chunks == NULL) {
+                fprintf(stderr, "Error: failed to allocate memory\n");
+                exit(EXIT_FAILURE);
+            }
+            arena->chunks[arena->chunk_count++] =
+                safe_malloc(ARENA_CHUNK_SIZE);
+        }
+        arena->used = 0;
+    }
+    char *ptr = arena->chunks[arena->current] + arena->used;
+    arena->used += size;
+    arena->bytes += size;
+    return ptr;
+}
+
+static void arena_reset(arena_t *arena) {
+    arena->current = 0;
+    arena->used = 0;
+    arena->bytes = 0;
+}
+
+static void arena_free(arena_t *arena) {
+    for (size_t i = 0; i < arena->chunk_count; i++) {
+        free(arena->chunks[i]);
+    }
+    free(arena->chunks);
+    arena->chunks = NULL;
+    arena->chunk_count = 0;
+    arena_reset(arena);
+}
+
+static void flush_buffer(data_t buf[], const size_t count) {
+    DEBUG(printf("keys in buffer: %lu\n", count);)
+
+    if (count == 0) {
+        return;
+    }
+
+    size_t unique = sort_put_buffer(buf, count);
+
+    uint64_t key;
+    for (size_t i = 0; i < unique; i++) {
+        key = buf[i].key;
 
         if (key < min_key || key > max_key) {
-            /* Looks up the metatable */
-            bool found = false;
-            uint64_t min_diff = (key < min_key) ? min_key - key : key - max_key;
-            int32_t min_diff_idx = -1;
-            for (int i = 0; i < meta_count; i++) {
-                bool loaded = (metatable[i].file_number == loaded_file);
-                found = (!loaded && key >= metatable[i].start_key &&
-                         key <= metatable[i].end_key);
-                if (found) {
-                    swap_files(&metatable[i]);
-                    min_key = metatable[i].start_key;
-                    max_key = metatable[i].end_key;
-                    break;
+            /* Looks up the metatable. The loaded file never covers the key
+             * since its key range is part of the range of the B+ tree. */
+            metadata_t *found = find_file(key);
+            if (found != NULL) {
+                /* swap_files() may reorder the metatable */
+                metadata_t file = *found;
+                swap_files(&file);
+                min_key = file.start_key;
+                max_key = file.end_key;
+            } else if (buf[i].length == 0) {
+                /* Neither a file nor the B+ tree holds the key, so the
+                 * tombstone has nothing to shadow */
+                continue;
+            } else {
+                /* The nearest files are the last file before the key and the
+                 * first file after it */
+                uint64_t min_diff =
+                    (key < min_key) ? min_key - key : key - max_key;
+                metadata_t *nearest = NULL;
+                size_t idx = count_files_before(key);
+                if (idx > 0 && key - metatable[idx - 1].end_key < min_diff) {
+                    min_diff = key - metatable[idx - 1].end_key;
+                    nearest = &metatable[idx - 1];
                 }
-                /* Finds the file whose start key is larger than and nearest
-                 * to the key */
-                if (key < metatable[i].start_key) {
-                    uint64_t diff = metatable[i].start_key - key;
-                    if (diff < min_diff) {
-                        min_diff = diff;
-                        min_diff_idx = i;
-                    }
-                } else if (key > metatable[i].end_key) {
-                    /* Finds the file whose end key is less than and nearest to
-                     * the key */
-                    uint64_t diff = key - metatable[i].end_key;
-                    if (diff < min_diff) {
-                        min_diff = diff;
-                        min_diff_idx = i;
-                    }
+                if (idx < meta_count &&
+                    metatable[idx].start_key - key < min_diff) {
+                    min_diff = metatable[idx].start_key - key;
+                    nearest = &metatable[idx];
                 }
-            }
-            if (!found) {
+
                 /* Swaps to the file whose start key or end key is nearest to
                  * the key */
                 bool need_to_swap =
-                    (min_diff_idx != -1 &&
-                     metatable[min_diff_idx].file_number != loaded_file);
+                    (nearest != NULL && nearest->file_number != loaded_file);
                 if (need_to_swap) {
-                    swap_files(&metatable[min_diff_idx]);
-                    min_key = MIN(key, metatable[min_diff_idx].start_key);
-                    max_key = MAX(key, metatable[min_diff_idx].end_key);
+                    metadata_t file = *nearest;
+                    swap_files(&file);
+                    min_key = MIN(key, file.start_key);
+                    max_key = MAX(key, file.end_key);
                 } else {
                     /* Already loaded the file whose start key or end key is
                      * nearest to the key */
@@ -389,9 +997,237 @@ static void flush_put_buffer() {
             }
         }
 
-        bptree.insert(key, value);
+        /* Flushes the B+ tree. Checked after the swap above, since the
+         * loaded file may already fill the tree. */
+        if (bptree.is_full()) {
+            /* Splits B+ tree into two parts and saves one of them depending on
+             * the current key */
+            char file[MAX_PATH + 1];
+            metadata_t metadata;
+            metadata.file_number = next_file_number++;
+            snprintf(file, MAX_PATH, "%s/%lu", dir_path, metadata.file_number);
+            bptree.split_and_save_one(&metadata, file, key);
+            update_metatable(&metadata);
+            if (loaded_file != -1) {
+                /* The loaded file is not overwritten: until the next
+                 * checkpoint, it holds the only durable copy of the keys that
+                 * stay in memory */
+                remove_metadata(loaded_file);
+                retire_file(loaded_file);
+            }
+            loaded_file = -1;
+            /* The key is adjacent to the part that stays in memory */
+            min_key = MIN(key, bptree.get_min_key());
+            max_key = MAX(key, bptree.get_max_key());
+            DEBUG(printf("min_key: %lu, max_key: %lu\n", min_key, max_key);)
+        }
+
+        bptree.insert(key, buf[i].value, buf[i].length);
     }
-    key_count = 0;
+}
+
+static bool compact_step() {
+    for (size_t n = 0; n < meta_count; n++) {
+        size_t first = (compaction_cursor + n) % meta_count;
+        if (!is_compactable(first)) {
+            continue;
+        }
+
+        /* Extends the run with the following files as long as the merged
+         * file stays within the target size */
+        size_t last = first;
+        uint64_t total_keys = metatable[first].total_keys;
+        uint64_t total_bytes = file_size(metatable[first].file_number);
+        while (last + 1 < meta_count && is_compactable(last + 1) &&
+               total_keys + metatable[last + 1].total_keys <=
+                   COMPACTION_TARGET_KEYS &&
+               total_bytes + file_size(metatable[last + 1].file_number) <=
+                   COMPACTION_TARGET_BYTES) {
+            /* The merged key range must not cover the B+ tree */
+            bool covers_bptree = (min_key <= max_key &&
+                                  min_key <= metatable[last + 1].end_key &&
+                                  max_key >= metatable[first].start_key);
+            if (covers_bptree) {
+                break;
+            }
+            last++;
+            total_keys += metatable[last].total_keys;
+            total_bytes += file_size(metatable[last].file_number);
+        }
+        if (last == first) {
+            continue;
+        }
+
+        merge_files(first, last);
+        compaction_cursor = first + 1;
+        return true;
+    }
+    return false;
+}
+
+static bool is_compactable(const size_t idx) {
+    /* The loaded file is out of date until the B+ tree is saved */
+    return metatable[idx].file_number != loaded_file &&
+           metatable[idx].total_keys < COMPACTION_TARGET_KEYS &&
+           file_size(metatable[idx].file_number) < COMPACTION_TARGET_BYTES;
+}
+
+static uint64_t file_size(const size_t file_number) {
+    char filepath[MAX_PATH + 1];
+    snprintf(filepath, MAX_PATH, "%s/%lu", dir_path, file_number);
+    struct stat st;
+    if (stat(filepath, &st) == -1) {
+        fprintf(stderr, "Error: failed to get the size of %s\n", filepath);
+        exit(EXIT_FAILURE);
+    }
+    return st.st_size;
+}
+
+static void merge_files(const size_t first, const size_t last) {
+    size_t count = last - first + 1;
+    size_t *file_numbers = safe_malloc(count * sizeof(size_t));
+    sstable_t *inputs = safe_malloc(count * sizeof(sstable_t));
+    pthread_mutex_lock(&meta_lock);
+    for (size_t i = 0; i < count; i++) {
+        file_numbers[i] = metatable[first + i].file_number;
+        inputs[i] = *get_table(file_numbers[i]);
+    }
+    pthread_mutex_unlock(&meta_lock);
+
+    char filepath[MAX_PATH + 1];
+    metadata_t metadata;
+    metadata.file_number = next_file_number++;
+    snprintf(filepath, MAX_PATH, "%s/%lu", dir_path, metadata.file_number);
+    printf("compacting %lu files into file %lu ...\n", count,
+           metadata.file_number);
+    sstable_merge(inputs, count, filepath, &metadata);
+
+    /* Replaces the merged files in the metatable at once. Files holding only
+     * tombstones merge into nothing. */
+    pthread_mutex_lock(&meta_lock);
+    if (metadata.total_keys == 0) {
+        remove(filepath);
+        memmove(&metatable[first], &metatable[last + 1],
+                (meta_count - last - 1) * sizeof(metadata_t));
+        meta_count -= count;
+    } else {
+        memmove(&metatable[first], &metatable[last],
+                (meta_count - last) * sizeof(metadata_t));
+        meta_count -= count - 1;
+        metatable[first] = metadata;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        retire_file(file_numbers[i]);
+    }
+    pthread_mutex_unlock(&meta_lock);
+    free(file_numbers);
+    free(inputs);
+}
+
+static bool compact_unlocked() {
+    compacting = true;
+    pthread_cond_broadcast(&flush_cond);
+    pthread_mutex_unlock(&flush_lock);
+
+    bool compacted = compact_step();
+
+    pthread_mutex_lock(&flush_lock);
+    compacting = false;
+    pthread_cond_broadcast(&flush_cond);
+    return compacted;
+}
+
+static void *flush_worker(void *arg) {
+    /* Files left by earlier sessions may need compaction too */
+    bool compaction_pending = true;
+    pthread_mutex_lock(&flush_lock);
+    while (true) {
+        while (flushing_buf == NULL && !stop_flush_thread) {
+            if (!idle_compaction || !compaction_pending) {
+                pthread_cond_wait(&flush_cond, &flush_lock);
+                continue;
+            }
+            /* Compacts one run of files once no buffer arrived for a
+             * while */
+            struct timespec deadline;
+            clock_gettime(CLOCK_MONOTONIC, &deadline);
+            deadline.tv_nsec += (COMPACTION_INTERVAL_US % 1000000) * 1000;
+            deadline.tv_sec += COMPACTION_INTERVAL_US / 1000000 +
+                               deadline.tv_nsec / 1000000000;
+            deadline.tv_nsec %= 1000000000;
+            int waited =
+                pthread_cond_timedwait(&flush_cond, &flush_lock, &deadline);
+            if (waited == ETIMEDOUT && flushing_buf == NULL &&
+                !stop_flush_thread) {
+                compaction_pending = compact_unlocked();
+            }
+        }
+        if (flushing_buf == NULL) {
+            break;
+        }
+        pthread_mutex_unlock(&flush_lock);
+
+        flush_buffer(flushing_buf, flushing_count);
+        arena_reset(flushing_arena);
+        if (flushing_seq >= saved_seq + CHECKPOINT_FLUSHES) {
+            checkpoint();
+        }
+
+        /* Hands the B+ tree back before compacting, so that foreground work
+         * does not wait for the merge */
+        pthread_mutex_lock(&flush_lock);
+        flushing_buf = NULL;
+        compaction_pending = compact_unlocked();
+    }
+    pthread_mutex_unlock(&flush_lock);
+    return NULL;
+}
+
+static void wait_for_flush() {
+    pthread_mutex_lock(&flush_lock);
+    while (flushing_buf != NULL) {
+        pthread_cond_wait(&flush_cond, &flush_lock);
+    }
+    pthread_mutex_unlock(&flush_lock);
+}
+
+static void wait_for_worker() {
+    pthread_mutex_lock(&flush_lock);
+    while (flushing_buf != NULL || compacting) {
+        pthread_cond_wait(&flush_cond, &flush_lock);
+    }
+    pthread_mutex_unlock(&flush_lock);
+}
+
+static void hand_over_put_buffer() {
+    pthread_mutex_lock(&flush_lock);
+    flushing_buf = put_buf;
+    flushing_count = key_count;
+    flushing_arena = put_arena;
+    pthread_cond_broadcast(&flush_cond);
+    pthread_mutex_unlock(&flush_lock);
+}
+
+static void flush_in_background() {
+    /* Backpressure: both buffers are full */
+    wait_for_flush();
+
+    if (!recovering) {
+        /* The rotated logs which were checkpointed are no longer needed once
+         * the bloom filter is saved. The records of put_buf stay in a rotated
+         * log until a checkpoint after the flush. */
+        bf.save();
+        wal.discard_rotated(saved_seq);
+        flushing_seq = wal.rotate();
+    }
+
+    hand_over_put_buffer();
+
+    bool first = (put_buf == put_bufs[0]);
+    put_buf = first ? put_bufs[1] : put_bufs[0];
+    put_arena = first ? &put_arenas[1] : &put_arenas[0];
+    reset_put_buffer();
 }
 
 /* extern functions */
@@ -401,18 +1237,19 @@ void init_database(database_t *db) {
     db->close = close;
     db->set_output_filename = set_output_filename;
     db->put = put;
+    db->del = del;
     db->get = get;
+    db->get_batch = get_batch;
     db->scan = scan;
 
-    /* Initializes the bloom filter and loads the previous bloom filter if
-     * available. */
+    /* Initializes the bloom filter and maps the previous bloom filter, or a
+     * new one. */
     init_bloomfilter(&bf);
 
     sprintf(bf_file_path, "%s/%s", dir_path, bf.state_file);
     safe_mkdir(dir_path, ACCESSPERMS);
 
-    if (file_exists(bf_file_path) == 0)
-        bf.load(bf_file_path);
+    bf.open(bf_file_path);
 
     /* Loads the previous metatable if available */
     if (file_exists(meta_file_path) == 0)
@@ -420,9 +1257,43 @@ void init_database(database_t *db) {
 
     /* Initializes B+ tree */
     init_bptree(&bptree);
+    block_cache_init(BLOCK_CACHE_SIZE);
 
-    put_buf = safe_malloc(MAX_BUFFER_SIZE * sizeof(data_t));
-    for (int i = 0; i < MAX_BUFFER_SIZE; i++) {
-        put_buf[i].value = safe_malloc((VALUE_LENGTH + 1) * sizeof(char));
+    for (int i = 0; i < 2; i++) {
+        put_bufs[i] = safe_malloc(MAX_BUFFER_SIZE * sizeof(data_t));
+        put_arenas[i] = (arena_t){NULL, 0, 0, 0, 0};
+    }
+    get_arena = (arena_t){NULL, 0, 0, 0, 0};
+    put_buf = put_bufs[0];
+    put_arena = &put_arenas[0];
+    put_index = safe_malloc(PUT_INDEX_SIZE * sizeof(uint32_t));
+    sort_scratch = safe_malloc(MAX_BUFFER_SIZE * sizeof(data_t));
+    reset_put_buffer();
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&flush_cond, &attr);
+    pthread_condattr_destroy(&attr);
+    if (pthread_create(&flush_thread, NULL, flush_worker, NULL) != 0) {
+        fprintf(stderr, "Error: failed to create the flush thread\n");
+        exit(EXIT_FAILURE);
     }
+
+    /* Recovers the PUTs which were not persisted before the last crash */
+    init_wal(&wal);
+    snprintf(wal_file_path, MAX_PATH, "%s/%s", dir_path, wal.log_file);
+    recovering = true;
+    wal.open(wal_file_path, buffer_put);
+    recovering = false;
+
+    /* Persists the recovered records, so that the log starts over */
+    flush_put_buffer();
+    checkpoint();
+    bf.save();
+    wal.clear();
+
+    pthread_mutex_lock(&flush_lock);
+    idle_compaction = true;
+    pthread_cond_broadcast(&flush_cond);
+    pthread_mutex_unlock(&flush_lock);
 }
\ No newline at end of file
@@ -1,13 +1,21 @@
 #ifndef DATABASE_H
 #define DATABASE_H
+#include <stddef.h>
 #include <stdint.h>
 
 typedef struct database {
     /* Closes the database */
     void (*close)();
     void (*set_output_filename)(const char *filename);
-    void (*put)(const uint64_t key, char *value);
+    /* Stores a value of 1 to MAX_VALUE_LENGTH bytes. */
+    void (*put)(const uint64_t key, const char *value, const size_t length);
+    /* Deletes the key. GET and SCAN answer EMPTY for it from then on. */
+    void (*del)(const uint64_t key);
     void (*get)(const uint64_t key);
+    /* Answers count GETs at once, resolving the keys in sorted order so that
+     * each storage file is read in one pass, and writes the results in the
+     * order of keys. */
+    void (*get_batch)(const uint64_t keys[], const size_t count);
     void (*scan)(const uint64_t start_key, const uint64_t end_key);
 } database_t;
 
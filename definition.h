@@ -4,7 +4,8 @@
 #include <stdint.h>
 
 #define MAX_PATH 128
-#define VALUE_LENGTH 128
+/* values are 1 to MAX_VALUE_LENGTH bytes long */
+#define MAX_VALUE_LENGTH 65536
 
 typedef struct {
     size_t file_number;
@@ -15,6 +16,7 @@ typedef struct {
 
 typedef struct data {
     uint64_t key;
+    uint32_t length;
     char *value;
 } data_t;
 
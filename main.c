@@ -1,5 +1,6 @@
 #include "database.h"
 #include "definition.h"
+#include "parser.h"
 #include "utils.h"
 #include <stdbool.h>
 #include <stdint.h>
@@ -7,8 +8,6 @@
 #include <stdlib.h>
 #include <string.h>
 
-#define MAX_CMD_LENGTH 200
-
 static void manage_database(const char *f_in);
 
 int main(int argc, char *argv[]) {
@@ -57,35 +56,76 @@ static void manage_database(const char *f_in) {
     database_t db;
     init_database(&db);
 
-    FILE *fp_in = safe_fopen(f_in, "r");
-
-    char cmd[MAX_CMD_LENGTH];
+    /* Batches are parsed by worker threads and executed here in file order
+     */
+    parser_t parser;
+    init_parser(&parser);
+    parser.open(f_in);
+    const command_t *commands;
+    size_t count;
     bool output_is_set = false;
-    while (fgets(cmd, MAX_CMD_LENGTH, fp_in) != NULL) {
-        // printf("%s", cmd);
-        uint64_t key1, key2;
-        static char value[VALUE_LENGTH + 1];
-        if (sscanf(cmd, "PUT %lu %s", &key1, value) == 2) {
-            // printf("PUT %lu %s\n", key1, value);
-            db.put(key1, value);
-        } else if (sscanf(cmd, "GET %lu", &key1) == 1) {
-            if (output_is_set == false) {
-                db.set_output_filename(f_out);
-                output_is_set = true;
-            }
-            // printf("GET %lu\n", key1);
-            db.get(key1);
-        } else if (sscanf(cmd, "SCAN %lu %lu", &key1, &key2) == 2) {
-            if (output_is_set == false) {
-                db.set_output_filename(f_out);
-                output_is_set = true;
+    /* keys of a run of GETs */
+    uint64_t *keys = NULL;
+    size_t key_capacity = 0;
+    while (parser.next(&commands, &count)) {
+        for (size_t i = 0; i < count; i++) {
+            const command_t *cmd = &commands[i];
+            switch (cmd->type) {
+            case CMD_PUT:
+                // printf("PUT %lu %.*s\n", cmd->key1, (int)cmd->length,
+                //        cmd->text);
+                db.put(cmd->key1, cmd->text, cmd->length);
+                break;
+            case CMD_DELETE:
+                // printf("DELETE %lu\n", cmd->key1);
+                db.del(cmd->key1);
+                break;
+            case CMD_GET:
+                if (output_is_set == false) {
+                    db.set_output_filename(f_out);
+                    output_is_set = true;
+                }
+                /* Runs of GETs are answered as one batch, a single GET on
+                 * its own */
+                size_t run = 0;
+                while (i + run < count && commands[i + run].type == CMD_GET) {
+                    if (run == key_capacity) {
+                        key_capacity = (key_capacity == 0) ? 1024
+                                                           : key_capacity << 1;
+                        keys = realloc(keys, key_capacity * sizeof(uint64_t));
+                        if (keys == NULL) {
+                            fprintf(stderr,
+                                    "Error: failed to allocate memory\n");
+                            exit(EXIT_FAILURE);
+                        }
+                    }
+                    // printf("GET %lu\n", commands[i + run].key1);
+                    keys[run] = commands[i + run].key1;
+                    run++;
+                }
+                if (run == 1) {
+                    db.get(keys[0]);
+                } else {
+                    db.get_batch(keys, run);
+                }
+                i += run - 1;
+                break;
+            case CMD_SCAN:
+                if (output_is_set == false) {
+                    db.set_output_filename(f_out);
+                    output_is_set = true;
+                }
+                // printf("SCAN %lu %lu\n", cmd->key1, cmd->key2);
+                db.scan(cmd->key1, cmd->key2);
+                break;
+            default:
+                fprintf(stderr, "Error: \"%.*s\" is an invalid command\n",
+                        (int)cmd->length, cmd->text);
+                break;
             }
-            // printf("SCAN %lu %lu\n", key1, key2);
-            db.scan(key1, key2);
-        } else {
-            fprintf(stderr, "Error: \"%s\" is an invalid command\n", cmd);
         }
     }
-    fclose(fp_in);
+    parser.close();
+    free(keys);
     db.close();
 }
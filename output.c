@@ -0,0 +1,152 @@
+#include "output.h"
+#include "utils.h"
+#include <fcntl.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#define EMPTY_RECORD "\nEMPTY"
+#define EMPTY_RECORD_SIZE (sizeof(EMPTY_RECORD) - 1)
+/* EMPTY records in the run written for long gaps of a scan */
+#define EMPTY_RUN_RECORDS ((1 << 16) / EMPTY_RECORD_SIZE)
+#define EMPTY_RUN_SIZE (EMPTY_RUN_RECORDS * EMPTY_RECORD_SIZE)
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+static int fd = -1;
+static char *buf = NULL;
+static size_t used = 0;
+/* bytes still to be dropped from the start of the output: the newline of the
+ * first record */
+static size_t skip = 0;
+/* EMPTY_RUN_RECORDS EMPTY records in a row */
+static char *empty_run = NULL;
+
+/* static function prototypes */
+static void open_output(const char *filepath);
+static void write_value(const char *value, const size_t length);
+static void write_empty(uint64_t count);
+static void close_output();
+/* Writes the buffer followed by iov_count more vectors to the file and empties
+ * the buffer. */
+static void flush(struct iovec iov[], const int iov_count);
+
+/* static functions */
+static void open_output(const char *filepath) {
+    fd = open(filepath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        fprintf(stderr, "Error: failed to open %s\n", filepath);
+        exit(EXIT_FAILURE);
+    }
+    buf = safe_malloc(OUTPUT_BUF_SIZE);
+    used = 0;
+    skip = 1;
+    empty_run = safe_malloc(EMPTY_RUN_SIZE);
+    for (size_t i = 0; i < EMPTY_RUN_RECORDS; i++) {
+        memcpy(empty_run + i * EMPTY_RECORD_SIZE, EMPTY_RECORD,
+               EMPTY_RECORD_SIZE);
+    }
+}
+
+static void write_value(const char *value, const size_t length) {
+    if (used + 1 + length > OUTPUT_BUF_SIZE) {
+        /* Writes the record along with the buffer rather than copying it */
+        struct iovec iov[2] = {{"\n", 1}, {(void *)value, length}};
+        flush(iov, 2);
+        return;
+    }
+    buf[used] = '\n';
+    memcpy(buf + used + 1, value, length);
+    used += 1 + length;
+}
+
+static void write_empty(uint64_t count) {
+    while (count > 0) {
+        if (count < EMPTY_RUN_RECORDS) {
+            if (used + count * EMPTY_RECORD_SIZE > OUTPUT_BUF_SIZE) {
+                flush(NULL, 0);
+            }
+            memcpy(buf + used, empty_run, count * EMPTY_RECORD_SIZE);
+            used += count * EMPTY_RECORD_SIZE;
+            return;
+        }
+        /* Long runs are written straight from the run, which is repeated
+         * as many times as one call takes */
+        struct iovec iov[IOV_MAX - 1];
+        int iov_count = 0;
+        while (iov_count < IOV_MAX - 1 && count >= EMPTY_RUN_RECORDS) {
+            iov[iov_count].iov_base = empty_run;
+            iov[iov_count].iov_len = EMPTY_RUN_SIZE;
+            iov_count++;
+            count -= EMPTY_RUN_RECORDS;
+        }
+        flush(iov, iov_count);
+    }
+}
+
+static void close_output() {
+    flush(NULL, 0);
+    close(fd);
+    fd = -1;
+    free(buf);
+    buf = NULL;
+    free(empty_run);
+    empty_run = NULL;
+}
+
+static void flush(struct iovec iov[], const int iov_count) {
+    struct iovec all[IOV_MAX];
+    int count = 0;
+    if (used > 0) {
+        all[count].iov_base = buf;
+        all[count].iov_len = used;
+        count++;
+    }
+    for (int i = 0; i < iov_count; i++) {
+        all[count++] = iov[i];
+    }
+    used = 0;
+
+    /* Every record starts with its newline, so the first vector holds the
+     * byte to drop */
+    if (skip > 0 && count > 0) {
+        all[0].iov_base = (char *)all[0].iov_base + skip;
+        all[0].iov_len -= skip;
+        skip = 0;
+    }
+
+    struct iovec *next = all;
+    while (count > 0) {
+        ssize_t n = writev(fd, next, count);
+        if (n == -1) {
+            fprintf(stderr, "Error: failed to write the output\n");
+            exit(EXIT_FAILURE);
+        }
+        /* Skips the vectors written in full and moves into the partly
+         * written one */
+        while (count > 0 && (size_t)n >= next->iov_len) {
+            n -= next->iov_len;
+            next++;
+            count--;
+        }
+        if (count > 0) {
+            next->iov_base = (char *)next->iov_base + n;
+            next->iov_len -= n;
+        }
+    }
+}
+
+/* extern functions */
+void init_output(output_t *output) {
+    output->open = open_output;
+    output->write_value = write_value;
+    output->write_empty = write_empty;
+    output->close = close_output;
+}
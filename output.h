@@ -0,0 +1,29 @@
+#ifndef OUTPUT_H
+#define OUTPUT_H
+#include <stddef.h>
+#include <stdint.h>
+
+/* Size of the buffer collecting the results before they are written. It can
+ * be overridden at compile time, e.g. -DOUTPUT_BUF_SIZE=$((64 << 20)). */
+#ifndef OUTPUT_BUF_SIZE
+#define OUTPUT_BUF_SIZE (4 << 20)
+#endif
+
+typedef struct output {
+    /* Creates the output file at filepath, truncating an existing one. */
+    void (*open)(const char *filepath);
+    /* Writes the value as the next result line. */
+    void (*write_value)(const char *value, const size_t length);
+    /* Writes count result lines of EMPTY. */
+    void (*write_empty)(uint64_t count);
+    /* Writes the buffered results and closes the output file. */
+    void (*close)();
+} output_t;
+
+/* Initializes the result writer. Every result is buffered as a newline
+ * followed by the line, and the newline before the first line is dropped when
+ * the buffer is written, so that the output holds one result per line with no
+ * trailing newline. */
+void init_output(output_t *output);
+
+#endif
@@ -0,0 +1,329 @@
+#include "parser.h"
+#include "utils.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/* A batch of commands parsed from one chunk */
+typedef struct batch {
+    command_t *commands;
+    size_t count;
+    size_t capacity;
+    bool ready;
+} batch_t;
+
+/* static variables */
+static const char *data = NULL;
+static size_t size = 0;
+/* chunk i spans from chunk_starts[i] to chunk_starts[i + 1] */
+static size_t *chunk_starts = NULL;
+static size_t chunk_count = 0;
+static pthread_t threads[MAX_PARSER_THREADS];
+static size_t thread_count = 0;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+/* Chunk i is parsed into batches[i % batch_count], so workers are at most
+ * batch_count chunks ahead of the executor */
+static batch_t *batches = NULL;
+static size_t batch_count = 0;
+/* the next chunk to be parsed */
+static size_t next_chunk = 0;
+/* the next chunk to be executed; the ones before it are done */
+static size_t next_batch = 0;
+static bool stop = false;
+
+/* static function prototypes */
+static void open_input(const char *filepath);
+static bool next(const command_t **commands, size_t *count);
+static void close_input();
+/* Parses chunks until every chunk has been parsed. */
+static void *parse_worker(void *arg);
+/* Parses the lines from start to end into batch. */
+static void parse_chunk(batch_t *batch, const char *start, const char *end);
+/* Parses the line from line to end into command. */
+static void parse_line(command_t *command, const char *line, const char *end);
+/* Returns true if c separates the fields of a command. */
+static inline bool is_space(const char c);
+/* Moves p past the spaces and tabs before end. */
+static inline void skip_spaces(const char **p, const char *end);
+/* Moves p past keyword if the command starts with it. Returns false if it
+ * does not. */
+static inline bool parse_keyword(const char **p, const char *end,
+                                 const char *keyword);
+/* Parses the decimal key following p, after at least one space, and moves p
+ * past it. Returns false if there is no key or it does not fit in 64 bits. */
+static inline bool parse_key(const char **p, const char *end, uint64_t *key);
+/* Returns the value of the 8 digits at p, or -1 if any of them is not a
+ * digit. */
+static inline int64_t parse_eight_digits(const char *p);
+
+/* static functions */
+static void open_input(const char *filepath) {
+    /* Commands are parsed in place in a mapping of the input file */
+    data = safe_mmap(filepath, &size);
+    if (data != NULL) {
+        madvise((void *)data, size, MADV_SEQUENTIAL);
+    }
+
+    /* Every chunk but the first starts after the first newline at or past
+     * its nominal offset */
+    chunk_count = (size + PARSER_CHUNK_SIZE - 1) / PARSER_CHUNK_SIZE;
+    chunk_starts = safe_malloc((chunk_count + 1) * sizeof(size_t));
+    chunk_starts[0] = 0;
+    for (size_t i = 1; i < chunk_count; i++) {
+        size_t start = MAX(i * PARSER_CHUNK_SIZE, chunk_starts[i - 1]);
+        const char *newline = memchr(data + start, '\n', size - start);
+        chunk_starts[i] = (newline == NULL) ? size : newline - data + 1;
+    }
+    chunk_starts[chunk_count] = size;
+
+    thread_count = PARSER_THREADS;
+    if (thread_count == 0) {
+        long processors = sysconf(_SC_NPROCESSORS_ONLN);
+        thread_count = (processors > 2) ? processors - 1 : 1;
+    }
+    thread_count = MIN(thread_count, MAX_PARSER_THREADS);
+    batch_count = 2 * thread_count;
+    batches = safe_calloc(batch_count, sizeof(batch_t));
+    next_chunk = 0;
+    next_batch = 0;
+    stop = false;
+    for (size_t i = 0; i < thread_count; i++) {
+        if (pthread_create(&threads[i], NULL, parse_worker, NULL) != 0) {
+            fprintf(stderr, "Error: failed to create a parser thread\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+static bool next(const command_t **commands, size_t *count) {
+    pthread_mutex_lock(&lock);
+    /* The previous batch has been executed, so its slot can be reused */
+    if (next_batch > 0) {
+        batches[(next_batch - 1) % batch_count].ready = false;
+        pthread_cond_broadcast(&cond);
+    }
+    if (next_batch == chunk_count) {
+        pthread_mutex_unlock(&lock);
+        return false;
+    }
+    batch_t *batch = &batches[next_batch % batch_count];
+    while (!batch->ready) {
+        pthread_cond_wait(&cond, &lock);
+    }
+    next_batch++;
+    pthread_mutex_unlock(&lock);
+
+    *commands = batch->commands;
+    *count = batch->count;
+    return true;
+}
+
+static void close_input() {
+    pthread_mutex_lock(&lock);
+    stop = true;
+    pthread_cond_broadcast(&cond);
+    pthread_mutex_unlock(&lock);
+    for (size_t i = 0; i < thread_count; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    for (size_t i = 0; i < batch_count; i++) {
+        free(batches[i].commands);
+    }
+    free(batches);
+    batches = NULL;
+    free(chunk_starts);
+    chunk_starts = NULL;
+    if (data != NULL) {
+        munmap((void *)data, size);
+        data = NULL;
+    }
+}
+
+static void *parse_worker(void *arg) {
+    pthread_mutex_lock(&lock);
+    while (true) {
+        /* Waits until the slot of the next chunk has been executed */
+        while (!stop && next_chunk < chunk_count &&
+               (next_chunk >= next_batch + batch_count ||
+                batches[next_chunk % batch_count].ready)) {
+            pthread_cond_wait(&cond, &lock);
+        }
+        if (stop || next_chunk == chunk_count) {
+            break;
+        }
+        size_t chunk = next_chunk++;
+        batch_t *batch = &batches[chunk % batch_count];
+        pthread_mutex_unlock(&lock);
+
+        parse_chunk(batch, data + chunk_starts[chunk],
+                    data + chunk_starts[chunk + 1]);
+
+        pthread_mutex_lock(&lock);
+        batch->ready = true;
+        pthread_cond_broadcast(&cond);
+    }
+    pthread_mutex_unlock(&lock);
+    return NULL;
+}
+
+static void parse_chunk(batch_t *batch, const char *start, const char *end) {
+    batch->count = 0;
+    for (const char *line = start; line < end;) {
+        const char *line_end = memchr(line, '\n', end - line);
+        if (line_end == NULL) {
+            line_end = end;
+        }
+        /* Blank lines are skipped */
+        if (line_end > line) {
+            if (batch->count == batch->capacity) {
+                batch->capacity =
+                    (batch->capacity == 0) ? 1024 : batch->capacity << 1;
+                batch->commands = realloc(
+                    batch->commands, batch->capacity * sizeof(command_t));
+                if (batch->commands == NULL) {
+                    fprintf(stderr, "Error: failed to allocate memory\n");
+                    exit(EXIT_FAILURE);
+                }
+            }
+            parse_line(&batch->commands[batch->count++], line, line_end);
+        }
+        line = line_end + 1;
+    }
+}
+
+static void parse_line(command_t *command, const char *line, const char *end) {
+    const char *p = line;
+    /* Dispatches on the first byte */
+    switch (*p) {
+    case 'P':
+        if (parse_keyword(&p, end, "PUT") &&
+            parse_key(&p, end, &command->key1)) {
+            /* The value runs until the next whitespace */
+            skip_spaces(&p, end);
+            const char *value = p;
+            while (p < end && !is_space(*p)) {
+                p++;
+            }
+            if (p > value) {
+                command->type = CMD_PUT;
+                command->text = value;
+                command->length = p - value;
+                return;
+            }
+        }
+        break;
+    case 'D':
+        if (parse_keyword(&p, end, "DELETE") &&
+            parse_key(&p, end, &command->key1)) {
+            command->type = CMD_DELETE;
+            return;
+        }
+        break;
+    case 'G':
+        if (parse_keyword(&p, end, "GET") &&
+            parse_key(&p, end, &command->key1)) {
+            command->type = CMD_GET;
+            return;
+        }
+        break;
+    case 'S':
+        if (parse_keyword(&p, end, "SCAN") &&
+            parse_key(&p, end, &command->key1) &&
+            parse_key(&p, end, &command->key2) &&
+            command->key1 <= command->key2) {
+            command->type = CMD_SCAN;
+            return;
+        }
+        break;
+    }
+    command->type = CMD_INVALID;
+    command->text = line;
+    command->length = end - line;
+}
+
+static inline bool is_space(const char c) {
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+static inline void skip_spaces(const char **p, const char *end) {
+    while (*p < end && is_space(**p)) {
+        (*p)++;
+    }
+}
+
+static inline bool parse_keyword(const char **p, const char *end,
+                                 const char *keyword) {
+    size_t length = strlen(keyword);
+    if ((size_t)(end - *p) < length || memcmp(*p, keyword, length) != 0) {
+        return false;
+    }
+    *p += length;
+    return true;
+}
+
+static inline bool parse_key(const char **p, const char *end, uint64_t *key) {
+    const char *start = *p;
+    skip_spaces(p, end);
+    if (*p == start || *p == end || **p < '0' || **p > '9') {
+        return false;
+    }
+
+    uint64_t result = 0;
+    const char *q = *p;
+    /* Eight digits at a time while they last, then one at a time */
+    int64_t digits;
+    while (end - q >= 8 && (digits = parse_eight_digits(q)) != -1) {
+        if (__builtin_mul_overflow(result, 100000000, &result) ||
+            __builtin_add_overflow(result, digits, &result)) {
+            return false;
+        }
+        q += 8;
+    }
+    while (q < end && *q >= '0' && *q <= '9') {
+        if (__builtin_mul_overflow(result, 10, &result) ||
+            __builtin_add_overflow(result, *q - '0', &result)) {
+            return false;
+        }
+        q++;
+    }
+    if (q < end && !is_space(*q)) {
+        return false;
+    }
+    *key = result;
+    *p = q;
+    return true;
+}
+
+static inline int64_t parse_eight_digits(const char *p) {
+    uint64_t chunk;
+    memcpy(&chunk, p, sizeof(uint64_t));
+    /* Every byte is 0x30 to 0x39: its high nibble is 3, and adding 6 to its
+     * low nibble does not carry */
+    if ((chunk & 0xf0f0f0f0f0f0f0f0ULL) != 0x3030303030303030ULL ||
+        ((chunk + 0x0606060606060606ULL) & 0xf0f0f0f0f0f0f0f0ULL) !=
+            0x3030303030303030ULL) {
+        return -1;
+    }
+    /* Combines adjacent digits into 2-digit, 4-digit and then 8-digit
+     * numbers; the first digit is in the lowest byte */
+    chunk -= 0x3030303030303030ULL;
+    chunk = (chunk * 10 + (chunk >> 8)) & 0x00ff00ff00ff00ffULL;
+    chunk = (chunk * 100 + (chunk >> 16)) & 0x0000ffff0000ffffULL;
+    chunk = (chunk * 10000 + (chunk >> 32)) & 0xffffffffULL;
+    return chunk;
+}
+
+/* extern functions */
+void init_parser(parser_t *parser) {
+    parser->open = open_input;
+    parser->next = next;
+    parser->close = close_input;
+}
@@ -0,0 +1,55 @@
+#ifndef PARSER_H
+#define PARSER_H
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* The input file is split at line boundaries into chunks of about
+ * PARSER_CHUNK_SIZE bytes, which worker threads parse into batches of
+ * commands while the batches before them are executed. PARSER_THREADS worker
+ * threads are started, or one less than the number of online processors if
+ * it is 0. Both can be overridden at compile time. */
+#ifndef PARSER_CHUNK_SIZE
+#define PARSER_CHUNK_SIZE (4 << 20)
+#endif
+#ifndef PARSER_THREADS
+#define PARSER_THREADS 0
+#endif
+#define MAX_PARSER_THREADS 16
+
+typedef enum command_type {
+    CMD_PUT,
+    CMD_GET,
+    CMD_SCAN,
+    CMD_DELETE,
+    /* a line which is not a command */
+    CMD_INVALID,
+} command_type_t;
+
+typedef struct command {
+    /* CMD_PUT: the value; CMD_INVALID: the line. Both point into the mapping
+     * of the input file. */
+    const char *text;
+    uint64_t key1;
+    /* CMD_SCAN: the end key */
+    uint64_t key2;
+    /* the length of text */
+    uint32_t length;
+    uint8_t type;
+} command_t;
+
+typedef struct parser {
+    /* Maps the input file at filepath and starts parsing it. */
+    void (*open)(const char *filepath);
+    /* Waits for the next batch in file order and points commands at it.
+     * The batch stays valid until the next call. Returns false when every
+     * batch has been read. */
+    bool (*next)(const command_t **commands, size_t *count);
+    /* Stops the worker threads and unmaps the input file. */
+    void (*close)();
+} parser_t;
+
+/* Initializes the command parser. */
+void init_parser(parser_t *parser);
+
+#endif
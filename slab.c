@@ -0,0 +1,92 @@
+#include "slab.h"
+#include "utils.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Static function prototypes */
+/* Returns the size class of size and stores the size of its slots in
+ * slot_size. */
+static size_t size_class(const size_t size, size_t *slot_size);
+
+static size_t size_class(const size_t size, size_t *slot_size) {
+    if (size <= SLAB_MIN_SLOT) {
+        *slot_size = SLAB_MIN_SLOT;
+        return 0;
+    }
+    /* Rounds size up to the next quarter of the power of two below it */
+    size_t bits = size - 1;
+    unsigned exponent = 63 - __builtin_clzl(bits);
+    unsigned step = exponent - 2;
+    size_t quarter = bits >> step;
+    *slot_size = (quarter + 1) << step;
+    return (exponent - 4) * 4 + (quarter - 4) + 1;
+}
+
+void slab_init(slab_arena_t *arena) {
+    memset(arena->classes, 0, sizeof(arena->classes));
+    arena->slabs = NULL;
+    arena->slab_count = 0;
+    arena->slabs_used = 0;
+    arena->bytes = 0;
+}
+
+char *slab_alloc(slab_arena_t *arena, const size_t size) {
+    size_t slot_size;
+    size_t idx = size_class(size, &slot_size);
+    if (idx >= SLAB_CLASS_COUNT || slot_size > SLAB_SIZE) {
+        fprintf(stderr, "Error: %lu bytes do not fit in a slab\n", size);
+        exit(EXIT_FAILURE);
+    }
+    slab_class_t *class = &arena->classes[idx];
+    arena->bytes += slot_size;
+
+    /* Reuses a released slot first */
+    if (class->free_list != NULL) {
+        char *ptr = class->free_list;
+        memcpy(&class->free_list, ptr, sizeof(char *));
+        return ptr;
+    }
+
+    if (class->cursor == NULL || class->end - class->cursor < slot_size) {
+        /* Starts carving the next slab, allocating it on first use */
+        if (arena->slabs_used == arena->slab_count) {
+            size_t slabs_size = (arena->slab_count + 1) * sizeof(char *);
+            arena->slabs = realloc(arena->slabs, slabs_size);
+            if (arena->slabs == NULL) {
+                fprintf(stderr, "Error: failed to allocate memory\n");
+                exit(EXIT_FAILURE);
+            }
+            arena->slabs[arena->slab_count++] = safe_malloc(SLAB_SIZE);
+        }
+        class->cursor = arena->slabs[arena->slabs_used++];
+        class->end = class->cursor + SLAB_SIZE;
+    }
+    char *ptr = class->cursor;
+    class->cursor += slot_size;
+    return ptr;
+}
+
+void slab_release(slab_arena_t *arena, char *ptr, const size_t size) {
+    size_t slot_size;
+    slab_class_t *class = &arena->classes[size_class(size, &slot_size)];
+    /* Slots are not aligned, so the link is copied byte by byte */
+    memcpy(ptr, &class->free_list, sizeof(char *));
+    class->free_list = ptr;
+    arena->bytes -= slot_size;
+}
+
+void slab_reset(slab_arena_t *arena) {
+    memset(arena->classes, 0, sizeof(arena->classes));
+    arena->slabs_used = 0;
+    arena->bytes = 0;
+}
+
+void slab_free(slab_arena_t *arena) {
+    for (size_t i = 0; i < arena->slab_count; i++) {
+        free(arena->slabs[i]);
+    }
+    free(arena->slabs);
+    slab_init(arena);
+}
@@ -0,0 +1,49 @@
+#ifndef SLAB_H
+#define SLAB_H
+#include <stddef.h>
+
+/* Size of the slabs the slots are carved from. Slots larger than a slab
+ * cannot be allocated. */
+#ifndef SLAB_SIZE
+#define SLAB_SIZE (1 << 20)
+#endif
+/* Slot sizes step by a quarter of a power of two from SLAB_MIN_SLOT bytes up,
+ * so that a slot wastes less than a fifth of its size. */
+#define SLAB_MIN_SLOT 16
+#define SLAB_CLASS_COUNT 64
+
+/* Slots of one size class */
+typedef struct slab_class {
+    /* released slots, each holding a pointer to the next one */
+    char *free_list;
+    /* the unused part of the slab being carved */
+    char *cursor;
+    char *end;
+} slab_class_t;
+
+/* Allocator of variably sized objects which are freed one by one or all at
+ * once. Objects of one size class are carved from shared slabs in allocation
+ * order, and the slabs are kept for reuse until the arena is freed. */
+typedef struct slab_arena {
+    slab_class_t classes[SLAB_CLASS_COUNT];
+    char **slabs;
+    size_t slab_count;
+    /* slabs[0] to slabs[slabs_used - 1] are being carved or carved */
+    size_t slabs_used;
+    /* total size of the slots in use */
+    size_t bytes;
+} slab_arena_t;
+
+/* Initializes an empty arena. */
+void slab_init(slab_arena_t *arena);
+/* Returns a slot of at least size bytes. */
+char *slab_alloc(slab_arena_t *arena, const size_t size);
+/* Makes the slot available again. size must be the size it was allocated
+ * with. */
+void slab_release(slab_arena_t *arena, char *ptr, const size_t size);
+/* Makes every slot available again in constant time. */
+void slab_reset(slab_arena_t *arena);
+/* Frees the slabs of the arena. */
+void slab_free(slab_arena_t *arena);
+
+#endif
@@ -1,62 +1,276 @@
 #include "sorting.h"
 #include "definition.h"
 #include "utils.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+
+/* Macros */
+/* The first pass distributes the records on the RADIX_BITS most significant
+ * bits in which the keys differ. The buckets it produces are small enough to
+ * stay in cache while an LSD radix sort with BUCKET_BITS-bit digits orders the
+ * bits below, and buckets of at most INSERTION_SORT_LIMIT records are
+ * insertion sorted instead. */
+#define RADIX_BITS 11
+#define RADIX_SIZE (1 << RADIX_BITS)
+#define RADIX_MASK (RADIX_SIZE - 1)
+#define BUCKET_BITS 8
+#define BUCKET_SIZE (1 << BUCKET_BITS)
+#define BUCKET_MASK (BUCKET_SIZE - 1)
+#define BUCKET_PASSES ((64 + BUCKET_BITS - 1) / BUCKET_BITS)
+#define INSERTION_SORT_LIMIT 32
+
+/* Structures */
+/* The work of one thread: a slice of the records during the first pass, then
+ * a range of buckets */
+typedef struct sort_task {
+    data_t *src;
+    data_t *dst;
+    size_t start;
+    size_t end;
+    unsigned shift;
+    /* the number of records of the slice per digit, then the position in dst
+     * of the next record of the slice per digit */
+    size_t offsets[RADIX_SIZE];
+    /* the first record of every bucket, and of the end of the last one */
+    const size_t *bounds;
+    size_t first_bucket;
+    size_t last_bucket;
+} sort_task_t;
 
 /* Static function prototypes */
-static void swap(data_t *d1, data_t *d2);
-static void merge(data_t arr[], const int32_t start, const int32_t middle,
-                  const int32_t end);
-
-static void swap(data_t *d1, data_t *d2) {
-    static data_t tmp;
-    tmp = *d1;
-    *d1 = *d2;
-    *d2 = tmp;
-}
-
-static void merge(data_t arr[], const int32_t start, const int32_t middle,
-                  const int32_t end) {
-    size_t len1 = middle - start + 1;
-    size_t len2 = end - middle;
-    data_t *a = safe_malloc(len1 * sizeof(data_t));
-    data_t *b = safe_malloc(len2 * sizeof(data_t));
-    size_t count1 = 0, count2 = 0;
-
-    /* Stores array to be sorted in two buffers */
-    for (int i = start; i <= middle; i++)
-        a[count1++] = arr[i];
-    for (int i = middle + 1; i <= end; i++)
-        b[count2++] = arr[i];
-
-    /* Merges the two buffers */
-    count1 = count2 = 0;
-    for (int i = start; i <= end; i++) {
-        if (count1 >= len1) {
-            arr[i] = b[count2++];
-        } else if (count2 >= len2) {
-            arr[i] = a[count1++];
-        } else if (a[count1].key <= b[count2].key) {
-            /* must use "<=" to achieve stable sorting */
-            arr[i] = a[count1++];
-        } else {
-            arr[i] = b[count2++];
-        }
-    }
-    free(a);
-    free(b);
-}
-
-void mergesort(data_t arr[], const int32_t start, const int32_t end) {
-    if (start >= end - 1) {
-        if (start == end - 1)
-            if (arr[start].key > arr[end].key)
-                swap(&arr[start], &arr[end]);
+/* Moves the records from src to dst in the order of the digit at shift, with
+ * SORT_THREADS threads each moving one slice if there are tasks. Stores the
+ * first record of every bucket in bounds. */
+static void distribute(data_t src[], data_t dst[], const size_t count,
+                       const unsigned shift, size_t bounds[RADIX_SIZE + 1],
+                       sort_task_t tasks[]);
+/* Sorts the buckets, with SORT_THREADS threads each sorting a range of buckets
+ * holding about as many records if there are tasks. */
+static void sort_buckets(data_t buckets[], data_t scratch[],
+                         const size_t count, const unsigned bits,
+                         const size_t bounds[RADIX_SIZE + 1],
+                         sort_task_t tasks[]);
+/* Sorts one bucket on the bits below bits with scratch as temporary space. */
+static void sort_bucket(data_t bucket[], data_t scratch[], const size_t count,
+                        const unsigned bits);
+/* Runs func on every task, one thread per task. */
+static void run_tasks(sort_task_t tasks[], void *(*func)(void *));
+/* Counts the digits of the slice of a task. */
+static void *count_task(void *arg);
+/* Moves the records of the slice of a task to their positions. */
+static void *distribute_task(void *arg);
+/* Sorts the buckets of a task. */
+static void *bucket_task(void *arg);
+
+static void distribute(data_t src[], data_t dst[], const size_t count,
+                       const unsigned shift, size_t bounds[RADIX_SIZE + 1],
+                       sort_task_t tasks[]) {
+    int threads = (tasks != NULL) ? SORT_THREADS : 1;
+    sort_task_t single;
+    if (tasks == NULL) {
+        tasks = &single;
+    }
+    size_t slice = (count + threads - 1) / threads;
+    for (int t = 0; t < threads; t++) {
+        tasks[t].src = src;
+        tasks[t].dst = dst;
+        tasks[t].start = MIN(count, t * slice);
+        tasks[t].end = MIN(count, (t + 1) * slice);
+        tasks[t].shift = shift;
+    }
+    if (threads == 1) {
+        count_task(&tasks[0]);
+    } else {
+        run_tasks(tasks, count_task);
+    }
+
+    /* The records of a digit go to dst slice by slice, and keep their order
+     * within a slice, which keeps the sort stable */
+    size_t sum = 0;
+    for (int digit = 0; digit < RADIX_SIZE; digit++) {
+        bounds[digit] = sum;
+        for (int t = 0; t < threads; t++) {
+            size_t records = tasks[t].offsets[digit];
+            tasks[t].offsets[digit] = sum;
+            sum += records;
+        }
+    }
+    bounds[RADIX_SIZE] = count;
+    if (threads == 1) {
+        distribute_task(&tasks[0]);
+    } else {
+        run_tasks(tasks, distribute_task);
+    }
+}
+
+static void sort_buckets(data_t buckets[], data_t scratch[],
+                         const size_t count, const unsigned bits,
+                         const size_t bounds[RADIX_SIZE + 1],
+                         sort_task_t tasks[]) {
+    int threads = (tasks != NULL) ? SORT_THREADS : 1;
+    sort_task_t single;
+    if (tasks == NULL) {
+        tasks = &single;
+    }
+    size_t bucket = 0;
+    for (int t = 0; t < threads; t++) {
+        tasks[t].src = buckets;
+        tasks[t].dst = scratch;
+        tasks[t].shift = bits;
+        tasks[t].bounds = bounds;
+        tasks[t].first_bucket = bucket;
+        /* Ends the range at the bucket holding the last record of its share
+         * of the records */
+        size_t share_end = count / threads * (t + 1);
+        while (bucket < RADIX_SIZE &&
+               (t == threads - 1 || bounds[bucket] < share_end)) {
+            bucket++;
+        }
+        tasks[t].last_bucket = bucket;
+    }
+    if (threads == 1) {
+        bucket_task(&tasks[0]);
+    } else {
+        run_tasks(tasks, bucket_task);
+    }
+}
+
+static void sort_bucket(data_t bucket[], data_t scratch[], const size_t count,
+                        const unsigned bits) {
+    if (count <= INSERTION_SORT_LIMIT) {
+        /* Moves a record only past greater keys, which keeps the sort
+         * stable */
+        for (size_t i = 1; i < count; i++) {
+            data_t record = bucket[i];
+            size_t j = i;
+            while (j > 0 && bucket[j - 1].key > record.key) {
+                bucket[j] = bucket[j - 1];
+                j--;
+            }
+            bucket[j] = record;
+        }
         return;
     }
 
-    int middle = (start + end) >> 1;
-    mergesort(arr, start, middle);
-    mergesort(arr, middle + 1, end);
-    merge(arr, start, middle, end);
-}
\ No newline at end of file
+    int passes = (bits + BUCKET_BITS - 1) / BUCKET_BITS;
+    uint32_t histograms[BUCKET_PASSES][BUCKET_SIZE];
+    memset(histograms, 0, passes * sizeof(histograms[0]));
+    for (size_t i = 0; i < count; i++) {
+        uint64_t key = bucket[i].key;
+        for (int pass = 0; pass < passes; pass++) {
+            histograms[pass][(key >> (pass * BUCKET_BITS)) & BUCKET_MASK]++;
+        }
+    }
+
+    /* The records move back and forth between bucket and scratch */
+    data_t *src = bucket, *dst = scratch;
+    for (int pass = 0; pass < passes; pass++) {
+        unsigned shift = pass * BUCKET_BITS;
+        uint32_t offsets[BUCKET_SIZE];
+        uint32_t sum = 0;
+        bool trivial = false;
+        for (int digit = 0; digit < BUCKET_SIZE; digit++) {
+            /* Skips the pass if every key has the same digit */
+            trivial |= (histograms[pass][digit] == count);
+            offsets[digit] = sum;
+            sum += histograms[pass][digit];
+        }
+        if (trivial) {
+            continue;
+        }
+        for (size_t i = 0; i < count; i++) {
+            dst[offsets[(src[i].key >> shift) & BUCKET_MASK]++] = src[i];
+        }
+        data_t *tmp = src;
+        src = dst;
+        dst = tmp;
+    }
+    if (src != bucket) {
+        memcpy(bucket, src, count * sizeof(data_t));
+    }
+}
+
+static void run_tasks(sort_task_t tasks[], void *(*func)(void *)) {
+    pthread_t threads[SORT_THREADS];
+    /* The calling thread handles the first task */
+    for (int t = 1; t < SORT_THREADS; t++) {
+        if (pthread_create(&threads[t], NULL, func, &tasks[t]) != 0) {
+            fprintf(stderr, "Error: failed to create a sorting thread\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    func(&tasks[0]);
+    for (int t = 1; t < SORT_THREADS; t++) {
+        pthread_join(threads[t], NULL);
+    }
+}
+
+static void *count_task(void *arg) {
+    sort_task_t *task = arg;
+    memset(task->offsets, 0, sizeof(task->offsets));
+    for (size_t i = task->start; i < task->end; i++) {
+        task->offsets[(task->src[i].key >> task->shift) & RADIX_MASK]++;
+    }
+    return NULL;
+}
+
+static void *distribute_task(void *arg) {
+    sort_task_t *task = arg;
+    for (size_t i = task->start; i < task->end; i++) {
+        const data_t *record = &task->src[i];
+        size_t digit = (record->key >> task->shift) & RADIX_MASK;
+        task->dst[task->offsets[digit]++] = *record;
+    }
+    return NULL;
+}
+
+static void *bucket_task(void *arg) {
+    sort_task_t *task = arg;
+    for (size_t b = task->first_bucket; b < task->last_bucket; b++) {
+        size_t start = task->bounds[b];
+        sort_bucket(&task->src[start], &task->dst[start],
+                    task->bounds[b + 1] - start, task->shift);
+    }
+    return NULL;
+}
+
+size_t radix_sort(data_t data[], data_t scratch[], const size_t count) {
+    if (count == 0) {
+        return 0;
+    }
+
+    /* The bits above the most significant bit in which the keys differ need
+     * no pass */
+    uint64_t diff = 0;
+    for (size_t i = 1; i < count; i++) {
+        diff |= data[i].key ^ data[0].key;
+    }
+    if (diff == 0) {
+        data[0] = data[count - 1];
+        return 1;
+    }
+    unsigned top = 64 - __builtin_clzll(diff);
+    unsigned shift = (top > RADIX_BITS) ? top - RADIX_BITS : 0;
+
+    bool parallel = (SORT_THREADS > 1 && count >= SORT_PARALLEL_THRESHOLD);
+    sort_task_t *tasks =
+        parallel ? safe_malloc(SORT_THREADS * sizeof(sort_task_t)) : NULL;
+    size_t bounds[RADIX_SIZE + 1];
+    distribute(data, scratch, count, shift, bounds, tasks);
+    sort_buckets(scratch, data, count, shift, bounds, tasks);
+    free(tasks);
+
+    /* Keeps the last record of every run of equal keys while moving the
+     * records back to data */
+    size_t unique = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (i + 1 < count && scratch[i + 1].key == scratch[i].key) {
+            continue;
+        }
+        data[unique++] = scratch[i];
+    }
+    return unique;
+}
@@ -1,7 +1,20 @@
 #ifndef SORTING_H
 #define SORTING_H
 #include "definition.h"
+#include <stddef.h>
 
-void mergesort(data_t data[], const int32_t start, const int32_t end);
+/* Number of threads sorting one array. Arrays shorter than
+ * SORT_PARALLEL_THRESHOLD are always sorted by the calling thread. */
+#ifndef SORT_THREADS
+#define SORT_THREADS 1
+#endif
+#ifndef SORT_PARALLEL_THRESHOLD
+#define SORT_PARALLEL_THRESHOLD (1 << 16)
+#endif
 
-#endif
\ No newline at end of file
+/* Sorts data by key with a stable LSD radix sort and keeps only the last
+ * record of every key, so that the latest write wins. scratch must hold count
+ * records. Returns the number of records left in data. */
+size_t radix_sort(data_t data[], data_t scratch[], const size_t count);
+
+#endif
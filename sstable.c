@@ -0,0 +1,414 @@
+#include "sstable.h"
+#include "cache.h"
+#include "definition.h"
+#include "utils.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/* static variables */
+static uint64_t next_table_id = 0;
+
+/* static function prototypes */
+/* Writes the current block padded with zeros and starts a new one. */
+static void finish_block(sstable_writer_t *writer);
+/* Writes a block holding only the record, which is too large to share a
+ * block. */
+static void write_large_block(sstable_writer_t *writer, const uint64_t key,
+                              const char *value, const size_t value_size);
+/* Returns the idx-th block of the table from the block cache, reading it from
+ * the file on a miss. */
+static const char *read_block(const sstable_t *table, const uint64_t idx);
+/* Returns the last block whose first key is less than or equal to key, or the
+ * first block if there is none. The table must hold at least one block. */
+static uint64_t find_block(const sstable_t *table, const uint64_t key);
+/* Returns the number of records stored in the block. */
+static inline uint16_t records_in_block(const char *block);
+/* Returns the key of the record. */
+static inline uint64_t record_key(const char *record);
+
+/* static functions */
+static void finish_block(sstable_writer_t *writer) {
+    memcpy(writer->block, &writer->block_records, sizeof(uint16_t));
+    memset(writer->block + writer->block_used, 0,
+           SSTABLE_BLOCK_SIZE - writer->block_used);
+    safe_fwrite(writer->block, sizeof(char), SSTABLE_BLOCK_SIZE,
+                writer->file);
+    writer->offset += SSTABLE_BLOCK_SIZE;
+    writer->block_used = SSTABLE_BLOCK_HEADER_SIZE;
+    writer->block_records = 0;
+}
+
+static void write_large_block(sstable_writer_t *writer, const uint64_t key,
+                              const char *value, const size_t value_size) {
+    static const char padding[SSTABLE_BLOCK_SIZE];
+    uint16_t count = 1;
+    size_t used = SSTABLE_BLOCK_HEADER_SIZE + sizeof(uint64_t) + value_size;
+    size_t size = (used + SSTABLE_BLOCK_SIZE - 1) / SSTABLE_BLOCK_SIZE *
+                  SSTABLE_BLOCK_SIZE;
+    safe_fwrite(&count, sizeof(uint16_t), 1, writer->file);
+    safe_fwrite(&key, sizeof(uint64_t), 1, writer->file);
+    safe_fwrite(value, sizeof(char), value_size, writer->file);
+    safe_fwrite(padding, sizeof(char), size - used, writer->file);
+    writer->offset += size;
+}
+
+static const char *read_block(const sstable_t *table, const uint64_t idx) {
+    uint64_t offset = table->index[idx].offset;
+    const char *block = block_cache_get(table->id, offset);
+    if (block != NULL) {
+        return block;
+    }
+
+    uint64_t end = (idx + 1 < table->block_count) ? table->index[idx + 1].offset
+                                                  : table->index_offset;
+    size_t size = end - offset;
+    char *buf = safe_malloc(size);
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = pread(table->fd, buf + done, size - done, offset + done);
+        if (n <= 0) {
+            fprintf(stderr, "Error: failed to read a storage file\n");
+            exit(EXIT_FAILURE);
+        }
+        done += n;
+    }
+    return block_cache_put(table->id, offset, buf, size);
+}
+
+static uint64_t find_block(const sstable_t *table, const uint64_t key) {
+    uint64_t lo = 0, hi = table->block_count - 1;
+    while (lo < hi) {
+        uint64_t mid = (lo + hi + 1) >> 1;
+        if (table->index[mid].key <= key) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return lo;
+}
+
+static inline uint16_t records_in_block(const char *block) {
+    uint16_t count;
+    memcpy(&count, block, sizeof(uint16_t));
+    return count;
+}
+
+static inline uint64_t record_key(const char *record) {
+    uint64_t key;
+    memcpy(&key, record, sizeof(uint64_t));
+    return key;
+}
+
+/* extern functions */
+void sstable_writer_open(sstable_writer_t *writer, const char *filepath) {
+    snprintf(writer->tmp_filepath, MAX_PATH, "%s.tmp", filepath);
+    writer->file = safe_fopen(writer->tmp_filepath, "wb");
+    writer->filepath = filepath;
+    writer->index_capacity = 1024;
+    writer->index =
+        safe_malloc(writer->index_capacity * sizeof(sstable_index_entry_t));
+    writer->key_capacity = 1024;
+    writer->keys = safe_malloc(writer->key_capacity * sizeof(uint64_t));
+    writer->block_count = 0;
+    writer->total_keys = 0;
+    writer->offset = 0;
+    writer->block_used = SSTABLE_BLOCK_HEADER_SIZE;
+    writer->block_records = 0;
+    writer->start_key = 0;
+    writer->end_key = 0;
+}
+
+void sstable_writer_append(sstable_writer_t *writer, const uint64_t key,
+                           const char *value) {
+    size_t value_size = value_encoded_size(value);
+    size_t record_size = sizeof(uint64_t) + value_size;
+    bool is_large =
+        (SSTABLE_BLOCK_HEADER_SIZE + record_size > SSTABLE_BLOCK_SIZE);
+    if (writer->block_records > 0 &&
+        (is_large || writer->block_used + record_size > SSTABLE_BLOCK_SIZE)) {
+        finish_block(writer);
+    }
+    if (writer->block_records == 0) {
+        /* Starts a new block and records its first key in the index */
+        if (writer->block_count == writer->index_capacity) {
+            writer->index_capacity <<= 1;
+            writer->index =
+                realloc(writer->index, writer->index_capacity *
+                                           sizeof(sstable_index_entry_t));
+            if (writer->index == NULL) {
+                fprintf(stderr, "Error: failed to allocate memory\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        writer->index[writer->block_count].key = key;
+        writer->index[writer->block_count].offset = writer->offset;
+        writer->block_count++;
+    }
+    if (writer->total_keys == writer->key_capacity) {
+        writer->key_capacity <<= 1;
+        writer->keys =
+            realloc(writer->keys, writer->key_capacity * sizeof(uint64_t));
+        if (writer->keys == NULL) {
+            fprintf(stderr, "Error: failed to allocate memory\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (writer->total_keys == 0) {
+        writer->start_key = key;
+    }
+    writer->end_key = key;
+    writer->keys[writer->total_keys++] = key;
+
+    if (is_large) {
+        write_large_block(writer, key, value, value_size);
+        return;
+    }
+    char *record = writer->block + writer->block_used;
+    memcpy(record, &key, sizeof(uint64_t));
+    memcpy(record + sizeof(uint64_t), value, value_size);
+    writer->block_used += record_size;
+    writer->block_records++;
+}
+
+void sstable_writer_close(sstable_writer_t *writer, metadata_t *metadata) {
+    if (writer->block_records > 0) {
+        finish_block(writer);
+    }
+
+    xor_filter_t filter;
+    xor_filter_build(&filter, writer->keys, writer->total_keys);
+    uint64_t filter_offset = writer->offset + writer->block_count *
+                                                  sizeof(sstable_index_entry_t);
+    sstable_footer_t footer = {
+        .index_offset = writer->offset,
+        .filter_offset = filter_offset,
+        .block_count = writer->block_count,
+        .total_keys = writer->total_keys,
+        .block_size = SSTABLE_BLOCK_SIZE,
+        .version = SSTABLE_VERSION,
+        .magic = SSTABLE_MAGIC,
+    };
+    safe_fwrite(writer->index, sizeof(sstable_index_entry_t),
+                writer->block_count, writer->file);
+    safe_fwrite(&filter.seed, sizeof(uint64_t), 1, writer->file);
+    safe_fwrite(&filter.segment_length, sizeof(uint64_t), 1, writer->file);
+    safe_fwrite(filter.fingerprints, sizeof(uint8_t), xor_filter_size(&filter),
+                writer->file);
+    safe_fwrite(&footer, sizeof(sstable_footer_t), 1, writer->file);
+    safe_commit_file(writer->file, writer->tmp_filepath, writer->filepath);
+    free(writer->index);
+    free(writer->keys);
+    free((void *)filter.fingerprints);
+
+    /* Updates metatable */
+    metadata->start_key = writer->start_key;
+    metadata->end_key = writer->end_key;
+    metadata->total_keys = writer->total_keys;
+
+    DEBUG(printf("saved %lu keys to %s\n", writer->total_keys,
+                 writer->filepath);)
+}
+
+void sstable_open(sstable_t *table, const char *filepath) {
+    table->data = safe_mmap(filepath, &table->size);
+    table->fd = open(filepath, O_RDONLY);
+    if (table->fd == -1) {
+        fprintf(stderr, "Error: failed to open %s\n", filepath);
+        exit(EXIT_FAILURE);
+    }
+    table->id = __atomic_fetch_add(&next_table_id, 1, __ATOMIC_RELAXED);
+
+    sstable_footer_t footer;
+    if (table->size < sizeof(sstable_footer_t)) {
+        fprintf(stderr, "Error: %s is not a storage file\n", filepath);
+        exit(EXIT_FAILURE);
+    }
+    memcpy(&footer, table->data + table->size - sizeof(sstable_footer_t),
+           sizeof(sstable_footer_t));
+    if (footer.magic != SSTABLE_MAGIC) {
+        fprintf(stderr, "Error: %s is not a storage file\n", filepath);
+        exit(EXIT_FAILURE);
+    }
+    if (footer.version != SSTABLE_VERSION ||
+        footer.block_size != SSTABLE_BLOCK_SIZE) {
+        fprintf(stderr, "Error: unsupported storage file version %u in %s\n",
+                footer.version, filepath);
+        exit(EXIT_FAILURE);
+    }
+
+    table->block_count = footer.block_count;
+    table->total_keys = footer.total_keys;
+    table->index =
+        (const sstable_index_entry_t *)(table->data + footer.index_offset);
+    table->index_offset = footer.index_offset;
+    const char *filter = table->data + footer.filter_offset;
+    memcpy(&table->filter.seed, filter, sizeof(uint64_t));
+    memcpy(&table->filter.segment_length, filter + sizeof(uint64_t),
+           sizeof(uint64_t));
+    table->filter.fingerprints = (const uint8_t *)filter + 2 * sizeof(uint64_t);
+}
+
+void sstable_close(sstable_t *table) {
+    munmap((void *)table->data, table->size);
+    close(table->fd);
+    table->fd = -1;
+    table->data = NULL;
+    table->index = NULL;
+}
+
+const char *sstable_get(const sstable_t *table, const uint64_t key) {
+    if (table->block_count == 0 || key < table->index[0].key ||
+        !xor_filter_contains(&table->filter, key)) {
+        return NULL;
+    }
+
+    /* Records vary in size, so the block is searched linearly */
+    const char *block = read_block(table, find_block(table, key));
+    const char *record = block + SSTABLE_BLOCK_HEADER_SIZE;
+    for (uint16_t i = records_in_block(block); i > 0; i--) {
+        uint64_t current = record_key(record);
+        const char *value = record + sizeof(uint64_t);
+        if (current >= key) {
+            return current == key ? value : NULL;
+        }
+        record = value + value_encoded_size(value);
+    }
+    return NULL;
+}
+
+void sstable_get_sorted(const sstable_t *table, const uint64_t keys[],
+                        const size_t count, const char *values[],
+                        const char *(*keep)(const char *value)) {
+    const char *block = NULL;
+    uint64_t block_idx = 0;
+    const char *record = NULL;
+    uint16_t remaining = 0;
+    for (size_t i = 0; i < count; i++) {
+        values[i] = NULL;
+        if (table->block_count == 0 || keys[i] < table->index[0].key ||
+            !xor_filter_contains(&table->filter, keys[i])) {
+            continue;
+        }
+        /* Reads the block of the key unless it is the current one */
+        uint64_t idx = find_block(table, keys[i]);
+        if (block == NULL || idx != block_idx) {
+            block = read_block(table, idx);
+            block_idx = idx;
+            record = block + SSTABLE_BLOCK_HEADER_SIZE;
+            remaining = records_in_block(block);
+        }
+        /* The keys are sorted, so the search goes on from the last record */
+        while (remaining > 0) {
+            uint64_t current = record_key(record);
+            const char *value = record + sizeof(uint64_t);
+            if (current >= keys[i]) {
+                if (current == keys[i]) {
+                    values[i] = keep(value);
+                }
+                break;
+            }
+            record = value + value_encoded_size(value);
+            remaining--;
+        }
+    }
+}
+
+void sstable_merge(const sstable_t tables[], const size_t count,
+                   const char *filepath, metadata_t *metadata) {
+    sstable_iter_t *iters = safe_malloc(count * sizeof(sstable_iter_t));
+    uint64_t *keys = safe_malloc(count * sizeof(uint64_t));
+    const char **values = safe_malloc(count * sizeof(char *));
+    bool *has_record = safe_malloc(count * sizeof(bool));
+    for (size_t i = 0; i < count; i++) {
+        sstable_iter_init(&iters[i], &tables[i]);
+        has_record[i] = sstable_iter_next(&iters[i], &keys[i], &values[i]);
+    }
+
+    sstable_writer_t writer;
+    sstable_writer_open(&writer, filepath);
+    while (true) {
+        /* Finds the smallest key; the last table holding it wins */
+        int64_t winner = -1;
+        for (size_t i = 0; i < count; i++) {
+            if (has_record[i] && (winner == -1 || keys[i] <= keys[winner])) {
+                winner = i;
+            }
+        }
+        if (winner == -1) {
+            break;
+        }
+        uint64_t key = keys[winner];
+        if (!value_is_tombstone(values[winner])) {
+            sstable_writer_append(&writer, key, values[winner]);
+        }
+        for (size_t i = 0; i < count; i++) {
+            if (has_record[i] && keys[i] == key) {
+                has_record[i] =
+                    sstable_iter_next(&iters[i], &keys[i], &values[i]);
+            }
+        }
+    }
+    sstable_writer_close(&writer, metadata);
+
+    free(iters);
+    free(keys);
+    free(values);
+    free(has_record);
+}
+
+void sstable_iter_init(sstable_iter_t *iter, const sstable_t *table) {
+    iter->table = table;
+    iter->record = table->data + SSTABLE_BLOCK_HEADER_SIZE;
+    iter->block = 0;
+    iter->block_remaining =
+        (table->block_count > 0) ? records_in_block(table->data) : 0;
+    madvise((void *)table->data, table->size, MADV_SEQUENTIAL);
+}
+
+void sstable_iter_seek(sstable_iter_t *iter, const sstable_t *table,
+                       const uint64_t key) {
+    iter->table = table;
+    iter->block = 0;
+    iter->block_remaining = 0;
+    if (table->block_count == 0) {
+        return;
+    }
+    iter->block = find_block(table, key);
+    const char *block = table->data + table->index[iter->block].offset;
+    iter->block_remaining = records_in_block(block);
+    iter->record = block + SSTABLE_BLOCK_HEADER_SIZE;
+    /* Skips the records of the block below key; if there are only such
+     * records, the next block starts above key */
+    while (iter->block_remaining > 0 && record_key(iter->record) < key) {
+        const char *value = iter->record + sizeof(uint64_t);
+        iter->record = value + value_encoded_size(value);
+        iter->block_remaining--;
+    }
+}
+
+bool sstable_iter_next(sstable_iter_t *iter, uint64_t *key,
+                       const char **value) {
+    while (iter->block_remaining == 0) {
+        if (iter->block + 1 >= iter->table->block_count) {
+            return false;
+        }
+        iter->block++;
+        const char *block =
+            iter->table->data + iter->table->index[iter->block].offset;
+        iter->block_remaining = records_in_block(block);
+        iter->record = block + SSTABLE_BLOCK_HEADER_SIZE;
+    }
+    *key = record_key(iter->record);
+    *value = iter->record + sizeof(uint64_t);
+    iter->record += sizeof(uint64_t) + value_encoded_size(*value);
+    iter->block_remaining--;
+    return true;
+}
@@ -0,0 +1,140 @@
+#ifndef SSTABLE_H
+#define SSTABLE_H
+#include "codec.h"
+#include "definition.h"
+#include "xorfilter.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* On-disk layout of a storage file (version 4):
+ *
+ *   block 0 | block 1 | ... | block n-1 | index | filter | footer
+ *
+ * Records (key followed by an encoded value, see codec.h) are grouped into
+ * blocks of SSTABLE_BLOCK_SIZE bytes. Each block starts with the number of
+ * records it holds. A record never spans two blocks, so the tail of each block
+ * is zero padded, and a record too large for a block gets a block of its own
+ * rounded up to a multiple of SSTABLE_BLOCK_SIZE. A deleted key is stored as a
+ * record whose value is a tombstone until compaction drops it. The index
+ * holds the first key and the offset of every block. The filter is an xor
+ * filter of all the keys (see xorfilter.h): its seed, its segment length and
+ * its fingerprints. The footer locates the index and the filter. */
+#define SSTABLE_MAGIC 0x31454c4241545353ULL /* "SSTABLE1" */
+#define SSTABLE_VERSION 4
+#define SSTABLE_BLOCK_SIZE 4096
+#define SSTABLE_BLOCK_HEADER_SIZE sizeof(uint16_t)
+
+typedef struct sstable_index_entry {
+    uint64_t key;
+    uint64_t offset;
+} sstable_index_entry_t;
+
+typedef struct sstable_footer {
+    uint64_t index_offset;
+    uint64_t filter_offset;
+    uint64_t block_count;
+    uint64_t total_keys;
+    uint32_t block_size;
+    uint32_t version;
+    uint64_t magic;
+} sstable_footer_t;
+
+typedef struct sstable_writer {
+    FILE *file;
+    const char *filepath;
+    /* records are written here and renamed to filepath when complete */
+    char tmp_filepath[MAX_PATH + 1];
+    /* first key and offset of every block written so far */
+    sstable_index_entry_t *index;
+    size_t index_capacity;
+    /* every key written so far, for building the filter */
+    uint64_t *keys;
+    size_t key_capacity;
+    uint64_t block_count;
+    uint64_t total_keys;
+    /* bytes written to the file so far */
+    uint64_t offset;
+    /* the current block, written out when the next record does not fit */
+    char block[SSTABLE_BLOCK_SIZE];
+    size_t block_used;
+    uint16_t block_records;
+    uint64_t start_key;
+    uint64_t end_key;
+} sstable_writer_t;
+
+/* A storage file mapped into memory. Records are parsed in place, except that
+ * sstable_get() reads blocks through the block cache (see cache.h). */
+typedef struct sstable {
+    /* identifies the opened file in the block cache; never reused, so that a
+     * rewritten file does not hit the blocks of its previous contents */
+    uint64_t id;
+    int fd;
+    const char *data;
+    size_t size;
+    uint64_t block_count;
+    uint64_t total_keys;
+    /* points into the mapping */
+    const sstable_index_entry_t *index;
+    uint64_t index_offset;
+    /* fingerprints point into the mapping */
+    xor_filter_t filter;
+} sstable_t;
+
+typedef struct sstable_iter {
+    const sstable_t *table;
+    const char *record;
+    /* records left in the current block */
+    uint16_t block_remaining;
+    uint64_t block;
+} sstable_iter_t;
+
+/* Starts writing a storage file. The file replaces filepath atomically when
+ * the writer is closed. */
+void sstable_writer_open(sstable_writer_t *writer, const char *filepath);
+/* Appends a record with an encoded value. Keys must be appended in increasing
+ * order. */
+void sstable_writer_append(sstable_writer_t *writer, const uint64_t key,
+                           const char *value);
+/* Writes the index and the footer, syncs and renames the file, and updates
+ * metadata. */
+void sstable_writer_close(sstable_writer_t *writer, metadata_t *metadata);
+
+/* Maps a storage file into memory and validates its footer. */
+void sstable_open(sstable_t *table, const char *filepath);
+/* Unmaps the storage file. */
+void sstable_close(sstable_t *table);
+/* Searches key by checking the filter first and then reading at most one block
+ * through the block cache. Returns a pointer to the encoded value inside the
+ * cached block, which stays valid until the next block is cached, or NULL if
+ * the key is not in the file. The value may be a tombstone. */
+const char *sstable_get(const sstable_t *table, const uint64_t key);
+
+/* Searches count keys, which must be sorted in increasing order, in one
+ * forward pass over the table that reads every block holding some of them
+ * once through the block cache. keep is called on the encoded value of every
+ * key found while its block is still cached, and values[i] is set to what it
+ * returns for keys[i], or to NULL if the key is not in the file. */
+void sstable_get_sorted(const sstable_t *table, const uint64_t keys[],
+                        const size_t count, const char *values[],
+                        const char *(*keep)(const char *value));
+
+/* Merges count storage files into a new storage file at filepath and updates
+ * metadata. On equal keys the record of the later table wins. Tombstones are
+ * dropped, since the key ranges of the files never overlap and no other file
+ * holds a value they shadow, so the new file may hold no keys at all. */
+void sstable_merge(const sstable_t tables[], const size_t count,
+                   const char *filepath, metadata_t *metadata);
+
+/* Positions the iterator at the first record of the table. */
+void sstable_iter_init(sstable_iter_t *iter, const sstable_t *table);
+/* Positions the iterator at the first record of the table whose key is
+ * greater than or equal to key. */
+void sstable_iter_seek(sstable_iter_t *iter, const sstable_t *table,
+                       const uint64_t key);
+/* Reads the next record. Returns false when all records have been read. */
+bool sstable_iter_next(sstable_iter_t *iter, uint64_t *key,
+                       const char **value);
+
+#endif
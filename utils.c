@@ -1,6 +1,8 @@
 #include "utils.h"
 #include <stddef.h>
+#include <fcntl.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
@@ -54,6 +56,41 @@ void safe_fwrite(const void *ptr, size_t size, size_t nmemb, FILE *stream) {
     }
 }
 
+void safe_commit_file(FILE *stream, const char *tmp_filename,
+                      const char *filename) {
+    if (fflush(stream) != 0 || fsync(fileno(stream)) == -1) {
+        fprintf(stderr, "Error: failed to write to %s\n", tmp_filename);
+        exit(EXIT_FAILURE);
+    }
+    fclose(stream);
+    if (rename(tmp_filename, filename) == -1) {
+        fprintf(stderr, "Error: failed to rename %s to %s\n", tmp_filename,
+                filename);
+        exit(EXIT_FAILURE);
+    }
+}
+
+const void *safe_mmap(const char *filename, size_t *size) {
+    int fd = open(filename, O_RDONLY);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        fprintf(stderr, "Error: failed to open %s\n", filename);
+        exit(EXIT_FAILURE);
+    }
+    *size = st.st_size;
+    if (*size == 0) {
+        close(fd);
+        return NULL;
+    }
+    void *ptr = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (ptr == MAP_FAILED) {
+        fprintf(stderr, "Error: failed to map %s\n", filename);
+        exit(EXIT_FAILURE);
+    }
+    return ptr;
+}
+
 void safe_mkdir(const char *directory, mode_t mode) {
     struct stat st;
     if (stat(directory, &st) == -1) {
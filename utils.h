@@ -38,6 +38,15 @@ void safe_fread(void *ptr, size_t size, size_t nmemb, FILE *stream);
 /* fwrite with error checking */
 void safe_fwrite(const void *ptr, size_t size, size_t nmemb, FILE *stream);
 
+/* Flushes the stream to disk, closes it and renames tmp_filename to filename,
+ * so that filename is replaced atomically. */
+void safe_commit_file(FILE *stream, const char *tmp_filename,
+                      const char *filename);
+
+/* Maps the whole file read-only into memory and stores its size in size.
+ * Returns NULL if the file is empty. */
+const void *safe_mmap(const char *filename, size_t *size);
+
 /* mkdir with error checking */
 void safe_mkdir(const char *directory, mode_t mode);
 
@@ -0,0 +1,362 @@
+#include "wal.h"
+#include "definition.h"
+#include "utils.h"
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+/* A record is the key, the value length, the value and the checksum of all
+ * three. A deletion is a record with an empty value. */
+#define RECORD_HEADER_SIZE (sizeof(uint64_t) + sizeof(uint32_t))
+#define RECORD_SIZE(length)                                                    \
+    (RECORD_HEADER_SIZE + (length) + sizeof(uint32_t))
+/* capacity of the pending buffer; a full buffer is committed early */
+#define PENDING_BUF_SIZE MAX(1 << 20, RECORD_SIZE(MAX_VALUE_LENGTH))
+
+static char log_file[] = "wal";
+static char log_path[MAX_PATH + 1];
+/* the rotated logs still on disk are numbered first_seq to next_seq - 1 */
+static uint64_t first_seq = 0;
+static uint64_t next_seq = 0;
+static int fd = -1;
+/* records waiting for the next group commit */
+static char *pending_buf = NULL;
+static size_t pending_count = 0;
+static size_t pending_size = 0;
+/* arrival time of the oldest pending record */
+static struct timespec pending_since;
+/* The sync thread commits the pending records once the oldest one is
+ * WAL_SYNC_INTERVAL_US old. The lock guards the log and the pending
+ * records. */
+static pthread_t sync_thread;
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t log_cond;
+static bool stop_sync_thread = false;
+
+/* static function prototypes */
+/* Calls put for every complete record of the log at filepath. Returns the
+ * size of the complete records. */
+static size_t replay(const char *filepath,
+                     void (*put)(const uint64_t key, const char *value,
+                                 const size_t length));
+/* Finds the rotated logs of the log at filepath and sets first_seq and
+ * next_seq. */
+static void find_rotated(const char *filepath);
+/* Returns the path of the rotated log numbered seq. */
+static const char *rotated_path(const uint64_t seq);
+static void open_log(const char *filepath,
+                     void (*put)(const uint64_t key, const char *value,
+                                 const size_t length));
+static void append(const uint64_t key, const char *value,
+                   const size_t length);
+static void sync_log();
+/* Writes and syncs all pending records. The caller holds log_lock. */
+static void commit();
+/* Commits the pending records whose deadline has passed until the log is
+ * closed. */
+static void *sync_worker(void *arg);
+static uint64_t rotate();
+static void discard_rotated(const uint64_t seq);
+static void clear();
+static void close_log();
+/* Returns the FNV-1a hash of the size bytes of the record before its
+ * checksum. */
+static uint32_t checksum(const char *record, const size_t size);
+/* Returns the microseconds elapsed since start. */
+static uint64_t elapsed_us(const struct timespec *start);
+
+/* static functions */
+static size_t replay(const char *filepath,
+                     void (*put)(const uint64_t key, const char *value,
+                                 const size_t length)) {
+    size_t valid_size = 0;
+    if (file_exists(filepath) == 0) {
+        size_t size;
+        const char *data = safe_mmap(filepath, &size);
+        size_t record_count = 0;
+        uint64_t key;
+        uint32_t length, sum;
+        while (valid_size + RECORD_HEADER_SIZE <= size) {
+            const char *record = data + valid_size;
+            memcpy(&length, record + sizeof(uint64_t), sizeof(uint32_t));
+            if (length > MAX_VALUE_LENGTH ||
+                valid_size + RECORD_SIZE(length) > size) {
+                break;
+            }
+            size_t record_size = RECORD_SIZE(length);
+            memcpy(&sum, record + record_size - sizeof(uint32_t),
+                   sizeof(uint32_t));
+            if (sum != checksum(record, record_size - sizeof(uint32_t))) {
+                break;
+            }
+            memcpy(&key, record, sizeof(uint64_t));
+            put(key, record + RECORD_HEADER_SIZE, length);
+            valid_size += record_size;
+            record_count++;
+        }
+        if (data != NULL) {
+            munmap((void *)data, size);
+        }
+        printf("replayed %lu records from %s\n", record_count, filepath);
+    }
+    return valid_size;
+}
+
+static void find_rotated(const char *filepath) {
+    const char *slash = strrchr(filepath, '/');
+    const char *name = (slash != NULL) ? slash + 1 : filepath;
+    size_t name_length = strlen(name);
+    char dir_path[MAX_PATH + 1];
+    snprintf(dir_path, sizeof(dir_path), "%.*s",
+             (slash != NULL) ? (int)(slash - filepath) : 1,
+             (slash != NULL) ? filepath : ".");
+
+    DIR *dir = opendir(dir_path);
+    if (dir == NULL) {
+        fprintf(stderr, "Error: failed to open %s\n", dir_path);
+        exit(EXIT_FAILURE);
+    }
+    first_seq = UINT64_MAX;
+    next_seq = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        /* Rotated logs are named after the log followed by "." and their
+         * sequence number */
+        if (strncmp(entry->d_name, name, name_length) != 0) {
+            continue;
+        }
+        const char *suffix = entry->d_name + name_length;
+        if (suffix[0] != '.' || suffix[1] < '0' || suffix[1] > '9') {
+            continue;
+        }
+        char *end;
+        uint64_t seq = strtoull(suffix + 1, &end, 10);
+        if (*end != '\0') {
+            continue;
+        }
+        first_seq = MIN(first_seq, seq);
+        next_seq = MAX(next_seq, seq + 1);
+    }
+    closedir(dir);
+    if (first_seq == UINT64_MAX) {
+        first_seq = next_seq;
+    }
+}
+
+static const char *rotated_path(const uint64_t seq) {
+    static char path[MAX_PATH + 22];
+    snprintf(path, sizeof(path), "%s.%lu", log_path, seq);
+    return path;
+}
+
+static void open_log(const char *filepath,
+                     void (*put)(const uint64_t key, const char *value,
+                                 const size_t length)) {
+    snprintf(log_path, sizeof(log_path), "%s", filepath);
+    find_rotated(filepath);
+
+    /* Replays the complete records, the older ones first */
+    for (uint64_t seq = first_seq; seq < next_seq; seq++) {
+        replay(rotated_path(seq), put);
+    }
+    size_t valid_size = replay(filepath, put);
+
+    fd = open(filepath, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd == -1) {
+        fprintf(stderr, "Error: failed to open %s\n", filepath);
+        exit(EXIT_FAILURE);
+    }
+    /* Drops the record torn by a crash so that new records follow the last
+     * complete one */
+    if (ftruncate(fd, valid_size) == -1) {
+        fprintf(stderr, "Error: failed to truncate %s\n", filepath);
+        exit(EXIT_FAILURE);
+    }
+    pending_buf = safe_malloc(PENDING_BUF_SIZE);
+    pending_count = 0;
+    pending_size = 0;
+
+    /* Deadlines are measured on the monotonic clock */
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&log_cond, &attr);
+    pthread_condattr_destroy(&attr);
+    stop_sync_thread = false;
+    if (pthread_create(&sync_thread, NULL, sync_worker, NULL) != 0) {
+        fprintf(stderr, "Error: failed to create the log sync thread\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void append(const uint64_t key, const char *value,
+                   const size_t length) {
+    size_t record_size = RECORD_SIZE(length);
+    pthread_mutex_lock(&log_lock);
+    if (pending_size + record_size > PENDING_BUF_SIZE) {
+        commit();
+    }
+    char *record = pending_buf + pending_size;
+    uint32_t length32 = length;
+    memcpy(record, &key, sizeof(uint64_t));
+    memcpy(record + sizeof(uint64_t), &length32, sizeof(uint32_t));
+    if (length > 0) {
+        memcpy(record + RECORD_HEADER_SIZE, value, length);
+    }
+    uint32_t sum = checksum(record, record_size - sizeof(uint32_t));
+    memcpy(record + record_size - sizeof(uint32_t), &sum, sizeof(uint32_t));
+    pending_size += record_size;
+
+    if (pending_count++ == 0) {
+        clock_gettime(CLOCK_MONOTONIC, &pending_since);
+        /* Starts the deadline of the sync thread */
+        pthread_cond_signal(&log_cond);
+    }
+    if (pending_count == WAL_SYNC_RECORDS ||
+        elapsed_us(&pending_since) >= WAL_SYNC_INTERVAL_US) {
+        commit();
+    }
+    pthread_mutex_unlock(&log_lock);
+}
+
+static void sync_log() {
+    pthread_mutex_lock(&log_lock);
+    commit();
+    pthread_mutex_unlock(&log_lock);
+}
+
+static void commit() {
+    if (pending_count == 0) {
+        return;
+    }
+    size_t size = pending_size;
+    size_t written = 0;
+    while (written < size) {
+        ssize_t n = write(fd, pending_buf + written, size - written);
+        if (n == -1) {
+            fprintf(stderr, "Error: failed to write to the log\n");
+            exit(EXIT_FAILURE);
+        }
+        written += n;
+    }
+    if (fdatasync(fd) == -1) {
+        fprintf(stderr, "Error: failed to sync the log\n");
+        exit(EXIT_FAILURE);
+    }
+    pending_count = 0;
+    pending_size = 0;
+}
+
+static void *sync_worker(void *arg) {
+    pthread_mutex_lock(&log_lock);
+    while (!stop_sync_thread) {
+        if (pending_count == 0) {
+            pthread_cond_wait(&log_cond, &log_lock);
+            continue;
+        }
+        struct timespec deadline = pending_since;
+        deadline.tv_nsec += (WAL_SYNC_INTERVAL_US % 1000000) * 1000;
+        deadline.tv_sec += WAL_SYNC_INTERVAL_US / 1000000 +
+                           deadline.tv_nsec / 1000000000;
+        deadline.tv_nsec %= 1000000000;
+        pthread_cond_timedwait(&log_cond, &log_lock, &deadline);
+        /* The records may have been committed meanwhile */
+        if (pending_count > 0 &&
+            elapsed_us(&pending_since) >= WAL_SYNC_INTERVAL_US) {
+            commit();
+        }
+    }
+    pthread_mutex_unlock(&log_lock);
+    return NULL;
+}
+
+static uint64_t rotate() {
+    pthread_mutex_lock(&log_lock);
+    commit();
+    uint64_t seq = next_seq++;
+    close(fd);
+    if (rename(log_path, rotated_path(seq)) == -1) {
+        fprintf(stderr, "Error: failed to rotate %s\n", log_path);
+        exit(EXIT_FAILURE);
+    }
+    fd = open(log_path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    if (fd == -1) {
+        fprintf(stderr, "Error: failed to open %s\n", log_path);
+        exit(EXIT_FAILURE);
+    }
+    pthread_mutex_unlock(&log_lock);
+    return seq;
+}
+
+static void discard_rotated(const uint64_t seq) {
+    /* The oldest logs go first, so that the remaining ones stay
+     * consecutive */
+    while (first_seq < MIN(seq, next_seq)) {
+        remove(rotated_path(first_seq));
+        first_seq++;
+    }
+}
+
+static void clear() {
+    pthread_mutex_lock(&log_lock);
+    pending_count = 0;
+    pending_size = 0;
+    if (ftruncate(fd, 0) == -1 || fdatasync(fd) == -1) {
+        fprintf(stderr, "Error: failed to clear the log\n");
+        exit(EXIT_FAILURE);
+    }
+    pthread_mutex_unlock(&log_lock);
+    discard_rotated(next_seq);
+}
+
+static void close_log() {
+    pthread_mutex_lock(&log_lock);
+    stop_sync_thread = true;
+    pthread_cond_signal(&log_cond);
+    pthread_mutex_unlock(&log_lock);
+    pthread_join(sync_thread, NULL);
+    pthread_cond_destroy(&log_cond);
+
+    sync_log();
+    close(fd);
+    fd = -1;
+    free(pending_buf);
+    pending_buf = NULL;
+}
+
+static uint32_t checksum(const char *record, const size_t size) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < size; i++) {
+        hash ^= (unsigned char)record[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static uint64_t elapsed_us(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000000 +
+           (now.tv_nsec - start->tv_nsec) / 1000;
+}
+
+/* extern functions */
+void init_wal(wal_t *wal) {
+    wal->log_file = log_file;
+    wal->open = open_log;
+    wal->append = append;
+    wal->sync = sync_log;
+    wal->rotate = rotate;
+    wal->discard_rotated = discard_rotated;
+    wal->clear = clear;
+    wal->close = close_log;
+}
@@ -0,0 +1,51 @@
+#ifndef WAL_H
+#define WAL_H
+#include <stddef.h>
+#include <stdint.h>
+
+/* Group commit: buffered records are written and synced to disk once
+ * WAL_SYNC_RECORDS records are pending, or by a background thread
+ * WAL_SYNC_INTERVAL_US microseconds after the oldest pending one arrived,
+ * and early if the pending records fill the buffer.
+ * Both can be overridden at compile time, e.g. -DWAL_SYNC_RECORDS=1 makes
+ * every PUT durable before it returns. */
+#ifndef WAL_SYNC_RECORDS
+#define WAL_SYNC_RECORDS 4096
+#endif
+#ifndef WAL_SYNC_INTERVAL_US
+#define WAL_SYNC_INTERVAL_US 10000
+#endif
+
+typedef struct wal {
+    /* Used for naming the log in the storage directory */
+    char *log_file;
+    /* Calls put for every complete record of the rotated logs and then of the
+     * log at filepath in the order they were appended, drops a torn tail and
+     * opens the log for appending. */
+    void (*open)(const char *filepath,
+                 void (*put)(const uint64_t key, const char *value,
+                             const size_t length));
+    /* Appends a record to the log. The record becomes durable at the next
+     * group commit. A length of 0 records the deletion of the key. */
+    void (*append)(const uint64_t key, const char *value, const size_t length);
+    /* Writes and syncs all pending records. */
+    void (*sync)();
+    /* Commits the pending records and starts a new log. The records so far
+     * are kept in a rotated log (filepath with "." and its sequence number
+     * appended) until it is discarded. Returns its sequence number, which is
+     * greater than that of every log rotated before. */
+    uint64_t (*rotate)();
+    /* Discards the rotated logs whose sequence number is below seq once their
+     * records have been persisted elsewhere. */
+    void (*discard_rotated)(const uint64_t seq);
+    /* Discards every record once all of them have been persisted elsewhere.
+     */
+    void (*clear)();
+    /* Closes the log and frees its buffer. */
+    void (*close)();
+} wal_t;
+
+/* Initializes the write-ahead log. */
+void init_wal(wal_t *wal);
+
+#endif
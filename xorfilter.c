@@ -0,0 +1,149 @@
+#include "xorfilter.h"
+#include "utils.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* gives up after this many seeds, which never happens unless keys repeat */
+#define MAX_ATTEMPTS 100
+
+/* a key peeled from the hypergraph and the slot it is assigned to */
+typedef struct peeled {
+    uint64_t hash;
+    uint64_t slot;
+} peeled_t;
+
+/* static function prototypes */
+/* Returns the hash of key under seed (the finalizer of MurmurHash3). */
+static inline uint64_t mix(const uint64_t key, const uint64_t seed);
+/* Returns the next seed of the splitmix64 sequence. */
+static uint64_t next_seed(uint64_t *state);
+/* Returns the i-th slot of the hash, one in each segment. */
+static inline uint64_t slot_of(const uint64_t hash, const int i,
+                               const uint64_t segment_length);
+static inline uint8_t fingerprint(const uint64_t hash);
+
+/* static functions */
+static inline uint64_t mix(const uint64_t key, const uint64_t seed) {
+    uint64_t h = key + seed;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+static uint64_t next_seed(uint64_t *state) {
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+static inline uint64_t slot_of(const uint64_t hash, const int i,
+                               const uint64_t segment_length) {
+    /* rotates the hash left by 0, 21 or 42 bits */
+    uint32_t r = (hash << (21 * i)) | (hash >> ((64 - 21 * i) & 63));
+    return ((uint64_t)r * segment_length >> 32) + i * segment_length;
+}
+
+static inline uint8_t fingerprint(const uint64_t hash) {
+    return hash ^ (hash >> 32);
+}
+
+/* extern functions */
+void xor_filter_build(xor_filter_t *filter, const uint64_t keys[],
+                      const size_t count) {
+    uint64_t segment_length = (32 + 1.23 * count) / 3;
+    size_t size = 3 * segment_length;
+    uint8_t *fingerprints = safe_calloc(size, sizeof(uint8_t));
+    /* per slot: the number of keys mapped to it and the xor of their
+     * hashes, so that the last key left in a slot is known */
+    uint32_t *slot_count = safe_malloc(size * sizeof(uint32_t));
+    uint64_t *slot_hash = safe_malloc(size * sizeof(uint64_t));
+    uint64_t *queue = safe_malloc(size * sizeof(uint64_t));
+    peeled_t *stack = safe_malloc(MAX(count, 1) * sizeof(peeled_t));
+
+    uint64_t state = 0x726b2b9d438b9d4dULL;
+    size_t stack_size = 0;
+    for (int attempt = 0; attempt < MAX_ATTEMPTS; attempt++) {
+        filter->seed = next_seed(&state);
+        memset(slot_count, 0, size * sizeof(uint32_t));
+        memset(slot_hash, 0, size * sizeof(uint64_t));
+        for (size_t i = 0; i < count; i++) {
+            uint64_t hash = mix(keys[i], filter->seed);
+            for (int j = 0; j < 3; j++) {
+                uint64_t slot = slot_of(hash, j, segment_length);
+                slot_count[slot]++;
+                slot_hash[slot] ^= hash;
+            }
+        }
+
+        /* Peels the keys which are alone in one of their slots until none
+         * is left */
+        size_t queue_size = 0;
+        for (size_t i = 0; i < size; i++) {
+            if (slot_count[i] == 1) {
+                queue[queue_size++] = i;
+            }
+        }
+        stack_size = 0;
+        while (queue_size > 0) {
+            uint64_t slot = queue[--queue_size];
+            if (slot_count[slot] != 1) {
+                continue;
+            }
+            uint64_t hash = slot_hash[slot];
+            stack[stack_size++] = (peeled_t){hash, slot};
+            for (int j = 0; j < 3; j++) {
+                uint64_t other = slot_of(hash, j, segment_length);
+                slot_count[other]--;
+                slot_hash[other] ^= hash;
+                if (slot_count[other] == 1) {
+                    queue[queue_size++] = other;
+                }
+            }
+        }
+        if (stack_size == count) {
+            break;
+        }
+    }
+    if (stack_size != count) {
+        fprintf(stderr, "Error: failed to build the xor filter\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* Assigns the slots in reverse peeling order, so that the other two
+     * slots of every key are final when its own slot is set */
+    while (stack_size > 0) {
+        peeled_t p = stack[--stack_size];
+        uint8_t value = fingerprint(p.hash);
+        for (int j = 0; j < 3; j++) {
+            uint64_t slot = slot_of(p.hash, j, segment_length);
+            if (slot != p.slot) {
+                value ^= fingerprints[slot];
+            }
+        }
+        fingerprints[p.slot] = value;
+    }
+
+    filter->segment_length = segment_length;
+    filter->fingerprints = fingerprints;
+    free(slot_count);
+    free(slot_hash);
+    free(queue);
+    free(stack);
+}
+
+bool xor_filter_contains(const xor_filter_t *filter, const uint64_t key) {
+    uint64_t hash = mix(key, filter->seed);
+    uint8_t value = fingerprint(hash);
+    for (int j = 0; j < 3; j++) {
+        value ^= filter->fingerprints[slot_of(hash, j, filter->segment_length)];
+    }
+    return value == 0;
+}
@@ -0,0 +1,30 @@
+#ifndef XORFILTER_H
+#define XORFILTER_H
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Static filter of a fixed set of distinct keys (Graf and Lemire, "Xor Filters:
+ * Faster and Smaller Than Bloom and Cuckoo Filters"). Each key maps to one
+ * 8-bit slot in each of three segments, and the slots are filled so that
+ * their xor equals the fingerprint of the key. About 9.8 bits per key for a
+ * false positive rate of 1/256, and a lookup reads exactly three bytes. */
+typedef struct xor_filter {
+    uint64_t seed;
+    /* number of slots in each of the three segments */
+    uint64_t segment_length;
+    const uint8_t *fingerprints;
+} xor_filter_t;
+
+/* Builds the filter of count distinct keys. The fingerprints are allocated
+ * with malloc(). */
+void xor_filter_build(xor_filter_t *filter, const uint64_t keys[],
+                      const size_t count);
+/* Returns false if key is definitely not in the filter. */
+bool xor_filter_contains(const xor_filter_t *filter, const uint64_t key);
+/* Returns the number of bytes of the fingerprints. */
+static inline size_t xor_filter_size(const xor_filter_t *filter) {
+    return 3 * filter->segment_length;
+}
+
+#endif